@@ -0,0 +1,655 @@
+/* Throughput benchmark of the engines of the library.
+   The library is compiled into the benchmark, so any engine can be
+   run for any pattern regardless of the one chosen by bm_compile().
+   The program is compiled in too, so the way it reads the input
+   is measured as well. */
+#define BITMATCH_MAIN bitmatch_main
+
+#include "libbitmatch.c"
+#include "use_engine.c"
+#include "bitmatch.c"
+
+/* Default size of each corpus in MiB. */
+#define BENCH_CORPUS_SIZE 16U
+/* Default number of runs of each engine. The fastest one is reported. */
+#define BENCH_NR_RUNS 3U
+/* The corpus is scanned in slices of this many bytes. A run stops
+   after the slice which exceeds the time limit in seconds, so the engines
+   hitting their worst case are measured on a part of the corpus. */
+#define BENCH_SLICE_SIZE (1U << 20)
+#define BENCH_TIME_LIMIT 1.0
+/* The set engine looks for this many patterns of the same length
+   taken from the corpus the way the single ones are. */
+#define BENCH_SET_SIZE 16U
+
+/* Lengths of the patterns looked for in each corpus.
+   60 bits take the two word state of shift-and automaton
+   without a specialised engine, 256 bits are around the threshold
+   of the skipping engine. */
+static const size_t bench_lengths[] = {
+    1U, 8U, 16U, 32U, 60U, 64U, 128U, 256U, 512U, 1024U, 4096U,
+};
+
+/* Pseudo-random numbers for the corpora and the patterns (xorshift64).
+   The seed is fixed, so the runs are comparable to each other. */
+static uint64_t bench_seed = UINT64_C(0x9E3779B97F4A7C15);
+
+static uint64_t bench_random(void)
+{
+    bench_seed ^= bench_seed << 13U;
+    bench_seed ^= bench_seed >> 7U;
+    bench_seed ^= bench_seed << 17U;
+
+    return bench_seed;
+}
+
+/* Uniformly distributed bytes. No long pattern occurs there. */
+static void fill_random(unsigned char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0U; i < size; i++)
+        buf[i] = (unsigned char) bench_random();
+}
+
+/* Bits set with probability 1/16, so the data consists of
+   long runs of zeros. The patterns are taken from the data itself. */
+static void fill_sparse(unsigned char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0U; i < size; i++) {
+        uint64_t val = bench_random();
+        unsigned int byte = 0U, j;
+
+        for (j = 0U; j < 8U; j++)
+            byte |= ((val >> (4U * j)) & 0xFU) == 0U ? 0x80U >> j : 0U;
+
+        buf[i] = (unsigned char) byte;
+    }
+}
+
+/* All zeros. The pattern of zeros followed by a single one
+   nearly matches at every position. */
+static void fill_zeros(unsigned char *buf, size_t size)
+{
+    memset(buf, 0, size);
+}
+
+/* Puts the pattern of @nr_bits bits to @pattern of (@nr_bits + 7) / 8 bytes.
+   @buf of @size bytes is the corpus the pattern is looked for in. */
+static void pick_random(unsigned char *pattern,
+                        size_t nr_bits,
+                        const unsigned char *buf,
+                        size_t size)
+{
+    (void) buf;
+    (void) size;
+
+    fill_random(pattern, (nr_bits + 7U) / 8U);
+}
+
+static void pick_substring(unsigned char *pattern,
+                           size_t nr_bits,
+                           const unsigned char *buf,
+                           size_t size)
+{
+    size_t offset, i;
+
+    offset = (size_t) (bench_random() % (size * 8U - nr_bits));
+
+    memset(pattern, 0, (nr_bits + 7U) / 8U);
+    for (i = 0U; i < nr_bits; i++)
+        if (extract_bitfield(buf, offset + i, 1) != 0U)
+            pattern[i / 8U] |= 0x80U >> (i % 8U);
+}
+
+static void pick_trailing_one(unsigned char *pattern,
+                              size_t nr_bits,
+                              const unsigned char *buf,
+                              size_t size)
+{
+    (void) buf;
+    (void) size;
+
+    memset(pattern, 0, (nr_bits + 7U) / 8U);
+    pattern[(nr_bits - 1U) / 8U] = 0x80U >> ((nr_bits - 1U) % 8U);
+}
+
+static const struct bench_corpus {
+    const char *name;
+    void (*fill)(unsigned char *buf, size_t size);
+    void (*pick)(unsigned char *pattern,
+                 size_t nr_bits,
+                 const unsigned char *buf,
+                 size_t size);
+} bench_corpora[] = {
+    { "random", fill_random, pick_random       },
+    { "sparse", fill_sparse, pick_substring    },
+    { "zeros",  fill_zeros,  pick_trailing_one },
+};
+
+/* The engines are run for the patterns compiled with @max_errors
+   errors allowed, or for the set of BENCH_SET_SIZE patterns
+   if @set is non-zero. */
+static const struct bench_engine {
+    const char *name;
+    int (*use)(struct bm_pattern *pat);
+    size_t max_errors;
+    int set;
+} bench_engines[] = {
+    { "rabin-karp",    use_rabin_karp,     0U, 0 },
+    { "shift-and",     use_shift_and,      0U, 0 },
+    { "shift-long",    use_long_shift_and, 0U, 0 },
+    { "prefilter",     use_prefilter,      0U, 0 },
+    { "horspool",      use_horspool,       0U, 0 },
+    { "simd-sse2",     use_simd_sse2,      0U, 0 },
+    { "simd-avx2",     use_simd_avx2,      0U, 0 },
+    { "simd-avx512",   use_simd_avx512,    0U, 0 },
+    { "hamming/1",     use_auto,           1U, 0 },
+    { "hamming/4",     use_auto,           4U, 0 },
+    { "hamming-all/1", use_hamming_all,    1U, 0 },
+    { "hamming-all/4", use_hamming_all,    4U, 0 },
+    { "set",           use_auto,           0U, 1 },
+};
+
+/* Counts the matches without printing them. */
+struct bench_sink {
+    struct bm_sink sink;
+    size_t nr_matches;
+};
+
+static int count_match(struct bm_sink *sink, size_t pos, size_t member)
+{
+    (void) pos;
+    (void) member;
+
+    ((struct bench_sink *) sink)->nr_matches++;
+    return 0;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) (now.tv_sec - start->tv_sec) +
+           (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Scans the slices of @buf of @size bytes until the time limit is exceeded.
+   The slices overlap the same way the slices of the parallel scan of
+   the program do. Returns the amount of bytes where the matches were
+   looked for. The time taken is put to @pseconds. */
+static size_t bench_scan(const struct bm_pattern *pat,
+                         const unsigned char *buf,
+                         size_t size,
+                         struct bm_sink *sink,
+                         double *pseconds)
+{
+    const size_t slice_bits = (size_t) BENCH_SLICE_SIZE * 8U;
+    struct timespec start;
+    size_t offset, end = size * 8U;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (offset = 0U; end - offset >= pat->nr_bits; offset += slice_bits) {
+        size_t slice_end = end - offset > slice_bits + pat->nr_bits - 1U ?
+                           offset + slice_bits + pat->nr_bits - 1U :
+                           end;
+
+        sink->skip_until = offset != 0U ? offset + pat->nr_bits - 1U : 0U;
+        bm_scan(pat, buf, offset, slice_end, sink);
+
+        if (slice_end == end || elapsed(&start) > BENCH_TIME_LIMIT) {
+            offset += slice_bits;
+            break;
+        }
+    }
+
+    *pseconds = elapsed(&start);
+    return offset < end ? offset / 8U : size;
+}
+
+/* Runs each engine @nr_runs times over @buf of @size bytes looking for
+   the patterns of @nr_bits bits and prints the fastest run.
+   @patterns holds BENCH_SET_SIZE of them one after another, each taking
+   (@nr_bits + 7) / 8 bytes. The set engine looks for all of them and
+   the others for the first one. The engine chosen by bm_compile()
+   is marked with '*'. @engine_name selects a single engine unless
+   it is NULL. */
+static int bench_pattern(const char *corpus_name,
+                         const unsigned char *buf,
+                         size_t size,
+                         const unsigned char *patterns,
+                         size_t nr_bits,
+                         const char *engine_name,
+                         unsigned int nr_runs)
+{
+    const size_t nr_bytes = (nr_bits + 7U) / 8U;
+    char *hex_seqs[BENCH_SET_SIZE], *hex_buf, err[256];
+    size_t lengths[BENCH_SET_SIZE], i, j;
+    int ret_val = BM_OK;
+
+    if ((hex_buf = malloc(BENCH_SET_SIZE * (nr_bytes * 2U + 1U))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return BM_NO_MEM;
+    }
+
+    for (i = 0U; i < BENCH_SET_SIZE; i++) {
+        hex_seqs[i] = hex_buf + i * (nr_bytes * 2U + 1U);
+        lengths[i] = nr_bits;
+
+        for (j = 0U; j < nr_bytes; j++)
+            sprintf(hex_seqs[i] + 2U * j, "%02x",
+                    patterns[i * nr_bytes + j]);
+    }
+
+    for (i = 0U; i < sizeof(bench_engines) / sizeof(bench_engines[0]); i++) {
+        const struct bench_engine *engine = &bench_engines[i];
+        struct bm_pattern *pat;
+        struct bench_sink bs, best_bs;
+        struct bm_stats stats, best_stats;
+        size_t nr_scanned, best_scanned = 0U, chosen_width;
+        double seconds, best = 0.0;
+        int (*chosen)(const struct bm_pattern *pat,
+                      const unsigned char *buf,
+                      size_t offset,
+                      size_t end,
+                      struct bm_sink *sink);
+        unsigned int run;
+
+        if (engine_name != NULL && strcmp(engine_name, engine->name) != 0)
+            continue;
+
+        /* Every position matches. */
+        if (engine->max_errors >= nr_bits)
+            continue;
+
+        if (engine->set)
+            ret_val = bm_compile_set((const char *const *) hex_seqs,
+                                     lengths,
+                                     BENCH_SET_SIZE,
+                                     &pat,
+                                     err,
+                                     sizeof(err));
+        else
+            ret_val = bm_compile(hex_seqs[0],
+                                 nr_bits,
+                                 NULL,
+                                 engine->max_errors,
+                                 &pat,
+                                 err,
+                                 sizeof(err));
+        if (ret_val != BM_OK) {
+            fprintf(stderr, "%s\n", err);
+            break;
+        }
+
+        /* The vector engine is chosen with the widest search routine. */
+        chosen = pat->engine;
+        chosen_width = pat->simd_width;
+
+        if ((ret_val = engine->use(pat)) != BM_OK) {
+            bm_free(pat);
+            if (ret_val == BM_NOT_FOUND) {
+                ret_val = BM_OK;
+                continue;
+            }
+            fprintf(stderr, "Failed to allocate memory\n");
+            break;
+        }
+
+        memset(&best_bs, 0, sizeof(best_bs));
+        memset(&best_stats, 0, sizeof(best_stats));
+
+        for (run = 0U; run < nr_runs; run++) {
+            memset(&bs, 0, sizeof(bs));
+            memset(&stats, 0, sizeof(stats));
+            bs.sink.report = count_match;
+            bs.sink.stats = &stats;
+
+            nr_scanned = bench_scan(pat, buf, size, &bs.sink, &seconds);
+
+            /* The rates of the runs covering different amounts of data
+               are compared. */
+            if (run == 0U ||
+                seconds * (double) best_scanned < best * (double) nr_scanned) {
+                best = seconds;
+                best_scanned = nr_scanned;
+                best_bs = bs;
+                best_stats = stats;
+            }
+        }
+
+        printf("%-8s %-14s%c %6zu %9.3f %9.3f %7.1f %10zu %10zu %10zu\n",
+               corpus_name,
+               engine->name,
+               pat->engine == chosen &&
+               pat->simd_width == chosen_width ? '*' : ' ',
+               nr_bits,
+               (double) best_scanned / best / 1e9,
+               best * 1e9 / (double) best_scanned,
+               (double) best_scanned / (1U << 20),
+               best_bs.nr_matches,
+               best_stats.nr_verified,
+               best_stats.nr_rejected);
+        fflush(stdout);
+
+        bm_free(pat);
+    }
+
+    free(hex_buf);
+    return ret_val;
+}
+
+/* Returns non-zero if there is a corpus or an engine named @name. */
+static int known_corpus(const char *name)
+{
+    size_t i;
+
+    for (i = 0U; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); i++)
+        if (strcmp(name, bench_corpora[i].name) == 0)
+            return 1;
+
+    return 0;
+}
+
+static int known_engine(const char *name)
+{
+    size_t i;
+
+    for (i = 0U; i < sizeof(bench_engines) / sizeof(bench_engines[0]); i++)
+        if (strcmp(name, bench_engines[i].name) == 0)
+            return 1;
+
+    return 0;
+}
+
+/* The data read by the ingest benchmark. */
+static const unsigned char bench_zeros[65536];
+
+/* Feeds the pipe with zeros for the ingest benchmark. */
+struct bench_writer {
+    int fd;
+    size_t size;
+};
+
+static void *write_zeros(void *arg)
+{
+    struct bench_writer *bw = arg;
+    size_t done = 0U;
+
+    while (done < bw->size) {
+        size_t count = bw->size - done < sizeof(bench_zeros) ?
+                       bw->size - done : sizeof(bench_zeros);
+        ssize_t nr_written;
+
+        if ((nr_written = write(bw->fd, bench_zeros, count)) < 0)
+            break;
+
+        done += (size_t) nr_written;
+    }
+
+    close(bw->fd);
+    return NULL;
+}
+
+/* Reads @size bytes with consume_input() the way the program reads
+   the input it can't map: from @fd, or from a pipe fed by a separate
+   thread if @fd is -1. The time taken is put to @pseconds
+   and the counters to @rs. */
+static int bench_ingest_once(int fd,
+                             size_t size,
+                             struct run_stats *rs,
+                             double *pseconds)
+{
+    struct bench_writer bw;
+    struct timespec start;
+    pthread_t writer;
+    unsigned char *buf;
+    size_t bufsz;
+    int fds[2], ret_val;
+
+    memset(rs, 0, sizeof(*rs));
+
+    if (fd == -1) {
+        if (pipe(fds) != 0) {
+            perror("Failed to create the pipe");
+            return BM_IO_ERR;
+        }
+
+        bw.fd = fds[1];
+        bw.size = size;
+        if (pthread_create(&writer, NULL, write_zeros, &bw) != 0) {
+            fprintf(stderr, "Failed to start the writer of the pipe\n");
+            close(fds[0]);
+            close(fds[1]);
+            return BM_IO_ERR;
+        }
+    } else if (lseek(fd, 0, SEEK_SET) != 0) {
+        perror("I/O error");
+        return BM_IO_ERR;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret_val = consume_input(fd == -1 ? fds[0] : fd, &buf, &bufsz, rs);
+    *pseconds = elapsed(&start);
+
+    if (fd == -1) {
+        close(fds[0]);
+        pthread_join(writer, NULL);
+    }
+
+    if (ret_val != BM_OK)
+        return ret_val;
+
+    free(buf);
+
+    if (bufsz != size) {
+        fprintf(stderr, "Read %zu bytes instead of %zu\n", bufsz, size);
+        return BM_IO_ERR;
+    }
+
+    return BM_OK;
+}
+
+/* Reads @size bytes of zeros from a pipe and from a temporary file
+   @nr_runs times each and prints the fastest run. */
+static int bench_ingest(size_t size, unsigned int nr_runs)
+{
+    static const char *const sources[] = { "pipe", "file" };
+    FILE *file;
+    size_t i, done, count;
+    unsigned int run;
+    int ret_val = BM_OK;
+
+    if ((file = tmpfile()) == NULL) {
+        perror("Failed to create the temporary file");
+        return BM_IO_ERR;
+    }
+
+    for (done = 0U; done < size; done += count) {
+        count = size - done < sizeof(bench_zeros) ?
+                size - done : sizeof(bench_zeros);
+        if (fwrite(bench_zeros, 1U, count, file) != count)
+            break;
+    }
+
+    if (done < size || fflush(file) != 0) {
+        perror("Failed to write the temporary file");
+        fclose(file);
+        return BM_IO_ERR;
+    }
+
+    printf("%-8s %7s %9s %9s %10s %10s\n",
+           "source", "MiB", "GB/s", "ns/byte", "reads", "reallocs");
+
+    for (i = 0U; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        struct run_stats best;
+        double best_seconds = 0.0;
+
+        memset(&best, 0, sizeof(best));
+
+        for (run = 0U; run < nr_runs; run++) {
+            struct run_stats rs;
+            double seconds;
+
+            ret_val = bench_ingest_once(i == 0U ? -1 : fileno(file),
+                                        size,
+                                        &rs,
+                                        &seconds);
+            if (ret_val != BM_OK)
+                break;
+
+            if (run == 0U || seconds < best_seconds) {
+                best = rs;
+                best_seconds = seconds;
+            }
+        }
+
+        if (ret_val != BM_OK)
+            break;
+
+        printf("%-8s %7zu %9.3f %9.3f %10zu %10zu\n",
+               sources[i],
+               size >> 20U,
+               (double) size / best_seconds / 1e9,
+               best_seconds * 1e9 / (double) size,
+               best.nr_reads,
+               best.nr_reallocs);
+    }
+
+    fclose(file);
+    return ret_val;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr,
+            "USAGE: bench [options]\n"
+            "where\n"
+            "    -s <MiB>    - size of each corpus (default %u)\n"
+            "    -r <nr>     - number of runs of each engine, "
+            "the fastest one is reported (default %u)\n"
+            "    -c <corpus> - run on a single corpus: "
+            "random, sparse or zeros\n"
+            "    -e <engine> - run a single engine: "
+            "rabin-karp, shift-and, shift-long,\n"
+            "                  prefilter, horspool, simd-sse2, simd-avx2,\n"
+            "                  simd-avx512, hamming/1, hamming/4,\n"
+            "                  hamming-all/1, hamming-all/4 or set\n"
+            "    -l <bits>   - look for the patterns of a single length\n"
+            "    -i          - measure reading the input from a pipe and "
+            "from a file\n"
+            "                  instead of the scan\n"
+            "    -h          - print this help\n",
+            BENCH_CORPUS_SIZE,
+            BENCH_NR_RUNS);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *corpus_name = NULL, *engine_name = NULL;
+    unsigned char *buf, *patterns;
+    size_t size = BENCH_CORPUS_SIZE, nr_bits = 0U, max_bytes, i, j, k;
+    unsigned int nr_runs = BENCH_NR_RUNS;
+    int opt, ingest = 0, ret_val = BM_OK;
+
+    while ((opt = getopt(argc, argv, "hs:r:c:e:l:i")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            nr_runs = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            corpus_name = optarg;
+            break;
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'l':
+            nr_bits = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            ingest = 1;
+            break;
+        case 'h':
+            bench_usage();
+            return EXIT_SUCCESS;
+        default:
+            bench_usage();
+            return BM_USAGE_ERR;
+        }
+    }
+
+    if (optind != argc || size == 0U || size > SIZE_MAX / 8U >> 20U ||
+        nr_runs == 0U || (nr_bits != 0U && nr_bits >= (size << 20U) * 8U) ||
+        (corpus_name != NULL && !known_corpus(corpus_name)) ||
+        (engine_name != NULL && !known_engine(engine_name)) ||
+        (ingest && (corpus_name != NULL || engine_name != NULL ||
+                    nr_bits != 0U))) {
+        bench_usage();
+        return BM_USAGE_ERR;
+    }
+
+    size <<= 20U;
+
+    if (ingest) {
+        ret_val = bench_ingest(size, nr_runs);
+        return ret_val == BM_OK ? EXIT_SUCCESS : ret_val;
+    }
+
+    max_bytes = 4096U / 8U > nr_bits / 8U + 1U ?
+                4096U / 8U : nr_bits / 8U + 1U;
+
+    buf = malloc(size);
+    patterns = malloc(BENCH_SET_SIZE * max_bytes);
+    if (buf == NULL || patterns == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(buf);
+        free(patterns);
+        return BM_NO_MEM;
+    }
+
+    printf("%-8s %-15s %6s %9s %9s %7s %10s %10s %10s\n",
+           "corpus", "engine", "bits", "GB/s", "ns/byte", "MiB",
+           "matches", "verified", "rejected");
+
+    for (i = 0U; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); i++) {
+        const struct bench_corpus *corpus = &bench_corpora[i];
+
+        if (corpus_name != NULL && strcmp(corpus_name, corpus->name) != 0)
+            continue;
+
+        corpus->fill(buf, size);
+
+        for (j = 0U; j < sizeof(bench_lengths) / sizeof(bench_lengths[0]);
+             j++) {
+            size_t len = nr_bits != 0U ? nr_bits : bench_lengths[j];
+
+            for (k = 0U; k < BENCH_SET_SIZE; k++)
+                corpus->pick(patterns + k * ((len + 7U) / 8U), len, buf, size);
+
+            ret_val = bench_pattern(corpus->name,
+                                    buf,
+                                    size,
+                                    patterns,
+                                    len,
+                                    engine_name,
+                                    nr_runs);
+            if (ret_val != BM_OK || nr_bits != 0U)
+                break;
+        }
+
+        if (ret_val != BM_OK)
+            break;
+    }
+
+    free(patterns);
+    free(buf);
+    return ret_val == BM_OK ? EXIT_SUCCESS : ret_val;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
@@ -5,38 +6,156 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "bitmatch.h"
+
+/* Initial capacity of the buffer holding the whole input,
+   unless the input size is known in advance. */
+#define INPUT_INITIAL_SIZE 65536U
+/* Upper limit for the amount of bytes requested by a single read. */
+#define INPUT_MAX_READ (1U << 30)
+
+/* The sizes of the chunks and slices below are overridable,
+   the fuzzer includes this file and makes them small. */
+
+/* Amount of bytes requested from stdin at once in streaming mode. */
+#ifndef STREAM_CHUNK_SIZE
+#define STREAM_CHUNK_SIZE 65536U
+#endif
+/* Streaming mode reads up to this many chunks ahead of the scan. */
+#ifndef READ_AHEAD_CHUNKS
+#define READ_AHEAD_CHUNKS 16U
+#endif
+/* The data shorter than the pattern is held back by the stream
+   until more arrives, or until the writer stays silent
+   for this many milliseconds. */
+#ifndef STREAM_FLUSH_DELAY
+#define STREAM_FLUSH_DELAY 10U
+#endif
+
+/* Parallel scan splits the input into slices of this many bytes.
+   Worker threads check whether the scan is cancelled between slices. */
+#ifndef THREAD_SLICE_SIZE
+#define THREAD_SLICE_SIZE (1U << 20)
+#endif
+/* Upper limit for the number of threads of the parallel scan. */
+#define MAX_THREADS 1024U
+/* The output of each of several files is kept in memory up to
+   this many bytes until the preceding files are printed. Beyond that,
+   the thread waits for its file to come next and prints the rest of
+   the output right away. */
+#define FILE_OUTPUT_MAX_SIZE (1U << 20)
+
+/* The index is built of the grams of this many bits by default.
+   The grams of 16 or 24 bits are supported. */
+#define INDEX_GRAM_BITS 16U
+/* Appended to the name of the file to get the name of its index. */
+#define INDEX_SUFFIX ".bmi"
+#define BLOCK_FILTER_SUFFIX ".bmb"
+/* The block filter tells which grams of 16 bits start in each block
+   of this many bytes. */
+#define BLOCK_FILTER_SIZE 65536U
+/* The size of the Bloom filter of each block in bits. */
+#define BLOCK_FILTER_BITS 16384U
+/* The number of the grams of the pattern tested against the filters. */
+#define BLOCK_FILTER_GRAMS 8U
+/* The index is not used if the rarest gram of the pattern starts at more
+   than 1 of this many bytes of the data, since scanning is cheaper then. */
+#define INDEX_MAX_DENSITY 64U
+/* The posting list this many times longer than the number of
+   the candidates isn't read, the candidates are verified instead. */
+#define INDEX_MAX_LIST_RATIO 16U
+
+/* Capacity of the buffer receiving the reason of a pattern failing
+   to compile. */
+#define ERROR_MSG_SIZE 256U
+
+/* The fuzzer and the benchmark rename main() of the program
+   to run their own one. */
+#ifndef BITMATCH_MAIN
+#define BITMATCH_MAIN main
+#endif
+
+/* Phases of the run timed for --stats. */
+enum run_phases {
+    PHASE_COMPILE,
+    PHASE_INPUT,
+    PHASE_SCAN,
+    NR_PHASES,
+};
 
-/* Change of the prime number used in hash function
-   requires change of initializer below because they are related. */
-#define PRIME_NUM 167U
-/* 2 ** -1 mod 167.
-   This initializer is chosen so we can compute 2 ** (nr_bits - 1) by
-   applying shifting and modulo reduction operations in a loop. */
-#define INIT_RNUM 84U
-
-enum bitmatch_exit_codes {
-    BM_FOUND        = 0,
-    BM_NOT_FOUND    = 1,
-    BM_OK           = 2,
-    BM_USAGE_ERR    = 3,
-    BM_INVALID_ARGS = 4,
-    BM_NO_MEM       = 5,
-    BM_IO_ERR       = 6,
+/* Statistics of the run printed with --stats.
+   The counters are cheap enough to be updated regardless,
+   the clocks are read only if the statistics are enabled.
+   Each thread scanning files keeps its own counters
+   which are added up once it is done. */
+struct run_stats {
+    int enabled;
+    /* Input obtained by read() calls or mapped to memory. */
+    size_t nr_bytes_read;
+    size_t nr_reads;
+    size_t nr_bytes_mapped;
+    /* Times the buffer holding the whole input was grown. */
+    size_t nr_reallocs;
+    /* Wall clock and CPU time spent in each phase in seconds. */
+    double wall[NR_PHASES];
+    double cpu[NR_PHASES];
+    /* Counters of the engines. */
+    struct bm_stats engine;
 };
 
 static void print_usage(void)
 {
     fprintf(stderr,
-            "USAGE: bitmatch <pattern> <bits nr>\n"
+            "USAGE: bitmatch [options] <pattern> <bits nr> [<file>...]\n"
+            "       bitmatch [options] -f <pattern file> [<file>...]\n"
+            "       bitmatch index [-q <gram bits> | -b] <file> "
+            "[<index file>]\n"
             "where\n"
-            "    <pattern> - sequence of hexadecimal digits\n"
-            "    <bits nr> - non-negative number of "
-            "significant bits in the bit pattern\n");
+            "    -s, --stream          - scan the input in fixed-size chunks "
+            "instead of reading it whole\n"
+            "    -j, --threads <nr>    - scan the input with the given number "
+            "of threads\n"
+            "    -a, --all             - print bit offsets of all matches\n"
+            "    -n, --non-overlapping - print bit offsets of "
+            "non-overlapping matches\n"
+            "    -c, --count           - print the number of matches; "
+            "non-overlapping ones with -n\n"
+            "    -f, --patterns <file> - look for all patterns listed "
+            "in the file, one per line\n"
+            "    -m, --mask <mask>     - hexadecimal digits telling which "
+            "bits of the pattern must match\n"
+            "    -k, --max-errors <nr> - accept matches differing from "
+            "the pattern in up to nr bits\n"
+            "    -r, --recursive       - scan the files in the directories "
+            "and their subdirectories\n"
+            "    -l, --files-with-matches\n"
+            "                          - print just the names of "
+            "the files with a match\n"
+            "    -i, --index <file>    - look the pattern up in the index "
+            "of the file instead of scanning it\n"
+            "        --stats           - print statistics of the run "
+            "to standard error\n"
+            "    -q <gram bits>        - build the index of the grams "
+            "of 16 or 24 bits\n"
+            "    -b                    - build the filter of the grams "
+            "of each block instead\n"
+            "    <pattern>             - sequence of hexadecimal digits\n"
+            "    <bits nr>             - non-negative number of "
+            "significant bits in the bit pattern\n"
+            "    <file>                - file, or directory with -r, to scan "
+            "instead of the standard input\n");
 }
 
 static void xfree(void *ptr);
@@ -84,73 +203,209 @@ static void xfree(void *ptr)
     free(ptr);
 }
 
-/* Extracts @count bits starting at @offset.
-   May traverse byte & word boundaries.
-   In a byte, the most significant bit has the least offset. */
-static unsigned int extract_bitfield(const unsigned char *buf,
-                                     size_t offset,
-                                     size_t count)
+/* Starts timing of some phase of the run by putting
+   the current wall clock and CPU time to @since. */
+static void begin_phase(const struct run_stats *rs, double since[2])
+{
+    struct timespec ts;
+
+    if (!rs->enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    since[0] = (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    since[1] = (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Adds the time passed since begin_phase() to @phase. */
+static void end_phase(struct run_stats *rs,
+                      enum run_phases phase,
+                      const double since[2])
 {
-    unsigned int val = 0U;
+    double now[2];
+
+    if (!rs->enabled)
+        return;
+
+    begin_phase(rs, now);
+    rs->wall[phase] += now[0] - since[0];
+    rs->cpu[phase] += now[1] - since[1];
+}
 
-    assert(0U < count && count <= 8U);
+/* Reads up to @count bytes from @fd to @buf.
+   Short reads are retried until @count bytes are obtained or EOF is reached.
+   Returns the amount of bytes read. If nothing was read
+   because of an error, -1 is returned and errno is set accordingly.
+   The reads are counted in @rs. */
+static ssize_t read_block(int fd,
+                          unsigned char *buf,
+                          size_t count,
+                          struct run_stats *rs)
+{
+    ssize_t nr_read = 0, nr_all_read = 0;
 
     while (count > 0U) {
-        size_t nr_avail, nr_consumed, nr_left;
-        unsigned int part, mask;
+        errno = 0;
+        nr_read = read(fd,
+                       buf + nr_all_read,
+                       count);
 
-        /* How many bits can be consumed in the current byte? */
-        nr_avail = 8U - (offset & 7U);
-        /* And how many bits are we supposed to consume? */
-        nr_consumed = count < nr_avail ? count : nr_avail;
-        /* Amount of the least significant bits in the current byte
-           which are next to consume. */
-        nr_left = nr_avail - nr_consumed;
+        if (nr_read < 0 && errno == EINTR)
+            continue;
 
-        part = buf[offset / 8U];
-        mask = ~((-1U << nr_avail) | ~(-1U << nr_left));
+        rs->nr_reads++;
+
+        if (nr_read <= 0)
+            break;
 
-        val = (val << nr_consumed) | ((part & mask) >> nr_left);
+        if ((size_t) nr_read > count) {
+            /* Treat this unlikely condition as out-of-range error.
+               Discard any possible data obtained from the last read. */
+            errno = ERANGE;
+            nr_read = -1;
+            break;
+        }
 
-        count -= nr_consumed;
-        offset += nr_consumed;
+        count -= (size_t) nr_read;
+        nr_all_read += nr_read;
+        rs->nr_bytes_read += (size_t) nr_read;
     }
 
-    return val;
+    /* Note: if we've managed to receive some data, discard any errors
+       from the last read. Assume that previous reads give us valid data. */
+    if (nr_all_read == 0 && nr_read == -1)
+        return -1;
+
+    return nr_all_read;
 }
 
-struct bit_pattern {
-    /* Buffer holding particular bit pattern. */
+/* Reads the whole data from @fd to allocated buffer.
+   The data is read directly to the buffer whose capacity is doubled
+   each time it is exhausted. The initial capacity is the amount of data
+   known to be available, if the descriptor can tell it. */
+static int consume_input(int fd,
+                         unsigned char **pbuf,
+                         size_t *pbufsz,
+                         struct run_stats *rs)
+{
     unsigned char *buf;
-    /* Capacity of the allocated buffer. */
-    size_t size;
-    /* The amount of relevant bits in the buffer. */
-    size_t nr_bits;
-    /* Pre-computed hash value of the pattern. */
-    unsigned int hash;
-    /* Cancel the effect of top-most bit on hash value by adding this number to
-       the current hash sum. */
-    unsigned int rnum;
-};
+    size_t bufsz = 0U, capacity = INPUT_INITIAL_SIZE;
+    struct stat st;
+    int nr_avail;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (uintmax_t) st.st_size < SIZE_MAX) {
+        /* One extra byte lets us see EOF without growing the buffer. */
+        capacity = (size_t) st.st_size + 1U;
+    } else if (ioctl(fd, FIONREAD, &nr_avail) == 0 &&
+               nr_avail > 0 && (size_t) nr_avail > capacity) {
+        capacity = (size_t) nr_avail;
+    }
+
+    buf = xmalloc(capacity);
+
+    while (1) {
+        ssize_t nr_all_read;
+        size_t count;
+
+        if (bufsz == capacity) {
+            if (capacity > SIZE_MAX / 2U) {
+                fprintf(stderr,
+                        "I/O error: "
+                        "Overflow detected while re-allocating buffer\n");
+                xfree(buf);
+                return BM_IO_ERR;
+            }
+
+            capacity *= 2U;
+            buf = xrealloc(buf, capacity);
+            rs->nr_reallocs++;
+        }
+
+        count = capacity - bufsz;
+        if (count > INPUT_MAX_READ)
+            count = INPUT_MAX_READ;
+
+        nr_all_read = read_block(fd, buf + bufsz, count, rs);
+
+        if (nr_all_read <= 0) {
+            /* We don't expect any errors. */
+            if (bufsz == 0U && nr_all_read == -1) {
+                perror("I/O error");
+                xfree(buf);
+                return BM_IO_ERR;
+            }
+
+            break;
+        }
+
+        bufsz += (size_t) nr_all_read;
+    }
 
-/* Unwrap command line arguments to binary data.
-   Ensure sanity of the resulting values. */
-static int get_pattern(char *hex_seq,
-                       char *nr_bits_s,
-                       struct bit_pattern *pat)
+    *pbuf = buf;
+    *pbufsz = bufsz;
+    return BM_OK;
+}
+
+/* Makes the whole data from @fd available in memory.
+   Regular files are mapped read-only, so the data isn't copied at all.
+   Other kinds of files, or the files which can't be mapped,
+   are read to allocated buffer. @pmapped tells which way was taken. */
+static int load_input(int fd,
+                      unsigned char **pbuf,
+                      size_t *pbufsz,
+                      int *pmapped,
+                      struct run_stats *rs)
 {
-    struct bit_pattern lpat;
-    unsigned char *next;
-    size_t nr_bits;
-    char *left;
-    /* 0 - if current character of the hex sequence is an upper half
-       of some byte;
-       1 - otherwise. */
-    int current_half = 0;
+    struct stat st;
+    void *addr;
+
+    *pmapped = 0;
+
+    if (fstat(fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) ||
+        (uintmax_t) st.st_size > SIZE_MAX)
+        return consume_input(fd, pbuf, pbufsz, rs);
+
+    /* Empty files can't be mapped. */
+    if (st.st_size == 0) {
+        *pbuf = NULL;
+        *pbufsz = 0U;
+        return BM_OK;
+    }
+
+    addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+        return consume_input(fd, pbuf, pbufsz, rs);
+
+    /* It's just a hint, so failure doesn't matter. */
+    (void) madvise(addr, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    *pbuf = addr;
+    *pbufsz = (size_t) st.st_size;
+    *pmapped = 1;
+    rs->nr_bytes_mapped += *pbufsz;
+    return BM_OK;
+}
+
+/* Releases the data obtained by load_input(). */
+static void release_input(unsigned char *buf, size_t bufsz, int mapped)
+{
+    if (mapped)
+        munmap(buf, bufsz);
+    else
+        xfree(buf);
+}
+
+/* Parses the number of bits of the pattern. */
+static int get_nr_bits(const char *nr_bits_s, size_t *nr_bits)
+{
+    unsigned long val;
+    char *left = NULL;
 
-    left = NULL;
     errno = 0;
-    nr_bits = strtoul(nr_bits_s, &left, 10);
+    val = strtoul(nr_bits_s, &left, 10);
     if (errno != 0) {
         perror("Failed to parse the number of bits");
         return BM_INVALID_ARGS;
@@ -164,270 +419,2337 @@ static int get_pattern(char *hex_seq,
                 "Failed to parse the number of bits: "
                 "Extra characters at the end of the argument\n");
         return BM_INVALID_ARGS;
-    } else if (nr_bits > SIZE_MAX - 7U) {
-        /* This helps us to ensure no overflows happening later on */
-        fprintf(stderr,
-                "Failed to parse the number of bits: "
-                "The number exceeds imposed limit\n");
-        return BM_INVALID_ARGS;
-    } else if (nr_bits == 0U) {
-        /* Empty bit pattern matches any data */
-        return BM_FOUND;
     }
 
-    /* Do we have enough hex digits to satisfy bit requirement? */
-    if ((nr_bits + 3U) / 4U > strlen(hex_seq)) {
+    *nr_bits = (size_t) val;
+    return BM_OK;
+}
+
+/* Unwrap command line arguments to the compiled pattern.
+   @mask_seq is the hex encoded mask of the pattern or NULL.
+   The matches may differ from the pattern in @max_errors bits. */
+static int get_pattern(const char *hex_seq,
+                       const char *nr_bits_s,
+                       const char *mask_seq,
+                       size_t max_errors,
+                       struct bm_pattern **ppat)
+{
+    char err[ERROR_MSG_SIZE];
+    size_t nr_bits;
+    int ret_val;
+
+    if ((ret_val = get_nr_bits(nr_bits_s, &nr_bits)) != BM_OK)
+        return ret_val;
+
+    /* Empty bit pattern matches any data */
+    if (nr_bits == 0U)
+        return BM_FOUND;
+
+    ret_val = bm_compile(hex_seq,
+                         nr_bits,
+                         mask_seq,
+                         max_errors,
+                         ppat,
+                         err,
+                         sizeof(err));
+    if (ret_val != BM_OK)
+        fprintf(stderr, "%s\n", err);
+
+    return ret_val;
+}
+
+/* Loads the set of patterns from the file at @path.
+   Each line of the file holds the pattern and the number of its bits
+   separated by whitespace, just like command line arguments do.
+   Empty lines and the lines starting with '#' are ignored.
+   The number of the line each pattern comes from is put
+   to the array returned in @plines. */
+static int get_pattern_set(const char *path,
+                           struct bm_pattern **ppat,
+                           size_t **plines)
+{
+    FILE *file;
+    char err[ERROR_MSG_SIZE];
+    char *line = NULL, **hex_seqs = NULL;
+    size_t *nr_bits = NULL, *lines = NULL;
+    size_t line_size = 0U, line_nr = 0U, capacity = 0U, nr_patterns = 0U, i;
+    int ret_val = BM_OK;
+
+    if ((file = fopen(path, "r")) == NULL) {
         fprintf(stderr,
-                "Failed to parse the bit sequence: "
-                "Can\'t obtain %zu bits from the sequence\n",
-                nr_bits);
-        return BM_INVALID_ARGS;
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                path,
+                strerror(errno));
+        return BM_IO_ERR;
     }
 
-    memset(&lpat, 0, sizeof(lpat));
-    lpat.rnum = INIT_RNUM;
-    lpat.hash = 0U;
-    lpat.nr_bits = nr_bits;
-    lpat.size = (lpat.nr_bits + 7U) / 8U;
-    next = lpat.buf = xmalloc(lpat.size);
+    while (getline(&line, &line_size, file) != -1) {
+        char *hex_seq, *nr_bits_s, *save = NULL;
+        const char *delim = " \t\r\n";
+        size_t len;
 
-    while (nr_bits > 0U) {
-        size_t count;
-        unsigned int val;
+        line_nr++;
 
-        val = *hex_seq++;
+        hex_seq = strtok_r(line, delim, &save);
+        if (hex_seq == NULL || *hex_seq == '#')
+            continue;
 
-        if (val >= '0' && val <= '9')
-            val -= '0';
-        else if (val >= 'A' && val <= 'F')
-            val -= 'A' - 10;
-        else if (val >= 'a' && val <= 'f')
-            val -= 'a' - 10;
-        else {
+        nr_bits_s = strtok_r(NULL, delim, &save);
+        if (nr_bits_s == NULL || strtok_r(NULL, delim, &save) != NULL) {
             fprintf(stderr,
-                    "Failed to parse the bit sequence: "
-                    "Invalid character at the position %zu\n",
-                    (size_t) (next - lpat.buf) * 2U + (size_t) current_half);
-            xfree(lpat.buf);
-            return BM_INVALID_ARGS;
+                    "Failed to parse the pattern set: "
+                    "Expected the pattern and the number of bits "
+                    "at the line %zu of %s\n",
+                    line_nr,
+                    path);
+            ret_val = BM_INVALID_ARGS;
+            break;
+        }
+
+        if (nr_patterns == capacity) {
+            capacity = capacity != 0U ? capacity * 2U : 16U;
+            hex_seqs = xrealloc(hex_seqs, capacity * sizeof(*hex_seqs));
+            nr_bits = xrealloc(nr_bits, capacity * sizeof(*nr_bits));
+            lines = xrealloc(lines, capacity * sizeof(*lines));
         }
 
-        count = nr_bits < 4U ? nr_bits : 4U;
+        ret_val = get_nr_bits(nr_bits_s, &nr_bits[nr_patterns]);
+        if (ret_val != BM_OK || nr_bits[nr_patterns] == 0U) {
+            fprintf(stderr,
+                    "Failed to parse the pattern set: "
+                    "%s pattern at the line %zu of %s\n",
+                    ret_val == BM_OK ? "Empty" : "Invalid",
+                    line_nr,
+                    path);
+            ret_val = BM_INVALID_ARGS;
+            break;
+        }
 
-        lpat.hash = ((lpat.hash << count) + (val >> (4U - count))) % PRIME_NUM;
-        lpat.rnum = (lpat.rnum << count) % PRIME_NUM;
+        len = strlen(hex_seq) + 1U;
+        hex_seqs[nr_patterns] = xmalloc(len);
+        memcpy(hex_seqs[nr_patterns], hex_seq, len);
+        lines[nr_patterns] = line_nr;
+        nr_patterns++;
+    }
 
-        if (!current_half)
-            *next = val << 4U;
-        else
-            *next++ |= val;
+    if (ret_val == BM_OK && ferror(file)) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to read %s\n",
+                path);
+        ret_val = BM_IO_ERR;
+    } else if (ret_val == BM_OK && nr_patterns == 0U) {
+        fprintf(stderr,
+                "Failed to parse the pattern set: "
+                "No patterns found in %s\n",
+                path);
+        ret_val = BM_INVALID_ARGS;
+    }
 
-        current_half = !current_half;
-        nr_bits -= count;
+    xfree(line);
+    fclose(file);
+
+    if (ret_val == BM_OK) {
+        ret_val = bm_compile_set((const char *const *) hex_seqs,
+                                 nr_bits,
+                                 nr_patterns,
+                                 ppat,
+                                 err,
+                                 sizeof(err));
+        if (ret_val != BM_OK)
+            fprintf(stderr, "%s in %s\n", err, path);
     }
 
-    lpat.rnum = PRIME_NUM - lpat.rnum;
+    for (i = 0U; i < nr_patterns; i++)
+        xfree(hex_seqs[i]);
+    xfree(hex_seqs);
+    xfree(nr_bits);
+
+    if (ret_val != BM_OK) {
+        xfree(lines);
+        return ret_val;
+    }
 
-    *pat = lpat;
+    *plines = lines;
     return BM_OK;
 }
 
-/* Reads the whole data from stdin to allocated buffer. */
-static int consume_stdin(unsigned char **pbuf, size_t *pbufsz)
+/* Stops the scan at the first match. */
+static int stop_at_first(struct bm_sink *sink, size_t pos, size_t member)
+{
+    (void) sink;
+    (void) pos;
+    (void) member;
+
+    return 1;
+}
+
+/* Prints offsets of the matches or counts them. */
+struct match_printer {
+    struct bm_sink sink;
+    const struct bm_pattern *pat;
+    /* Receives the offsets. */
+    FILE *out;
+    /* The name of the scanned file printed before each offset,
+       or NULL if just one input is scanned. */
+    const char *name;
+    /* The numbers of the lines the patterns of the set come from.
+       NULL for a single pattern. */
+    const size_t *member_lines;
+    /* Accept only the matches starting past the end of the previous one.
+       The matches of a set are accepted in order of their end offsets. */
+    int non_overlapping;
+    /* The least offset of the next match to be accepted. */
+    size_t next;
+    /* Count the matches instead of printing them. */
+    int count_only;
+    size_t nr_matches;
+};
+
+/* The matches of a set are printed along with the numbers of the lines
+   the patterns come from. */
+static int print_match(struct bm_sink *sink, size_t pos, size_t member)
+{
+    struct match_printer *mp = (struct match_printer *) sink;
+
+    pos += sink->base;
+
+    if (mp->non_overlapping && pos < mp->next)
+        return 0;
+
+    if (!mp->count_only && mp->name != NULL)
+        fprintf(mp->out, "%s:", mp->name);
+
+    if (!mp->count_only && mp->member_lines != NULL)
+        fprintf(mp->out, "%zu %zu\n", pos, mp->member_lines[member]);
+    else if (!mp->count_only)
+        fprintf(mp->out, "%zu\n", pos);
+
+    mp->nr_matches++;
+    mp->next = pos + bm_member_bits(mp->pat, member);
+
+    return 0;
+}
+
+/* Feeds data from @fd to the stream scan in chunks of STREAM_CHUNK_SIZE bytes.
+   Returns as soon as @sink asks to stop leaving the rest of input unread. */
+static int scan_stream(const struct bm_pattern *pat,
+                       int fd,
+                       struct bm_sink *sink,
+                       struct run_stats *rs)
+{
+    struct bm_stream *stream;
+    unsigned char *buf;
+    size_t nr_all_read = 0U;
+    int ret_val = BM_NOT_FOUND;
+
+    if (bm_stream_open(pat, sink, &stream) != BM_OK) {
+        fprintf(stderr, "Failed to allocate memory for the stream\n");
+        return BM_NO_MEM;
+    }
+
+    buf = xmalloc(STREAM_CHUNK_SIZE);
+
+    while (!sink->stopped) {
+        ssize_t nr_read;
+        double since[2];
+
+        begin_phase(rs, since);
+        nr_read = read_block(fd, buf, STREAM_CHUNK_SIZE, rs);
+        end_phase(rs, PHASE_INPUT, since);
+
+        begin_phase(rs, since);
+
+        if (nr_read <= 0) {
+            if (nr_read == -1 && nr_all_read == 0U) {
+                perror("I/O error");
+                ret_val = BM_IO_ERR;
+            } else if (bm_stream_finish(stream) == BM_FOUND) {
+                ret_val = BM_FOUND;
+            }
+
+            end_phase(rs, PHASE_SCAN, since);
+            break;
+        }
+
+        nr_all_read += (size_t) nr_read;
+
+        if (bm_feed(stream, buf, (size_t) nr_read) == BM_FOUND)
+            ret_val = BM_FOUND;
+
+        end_phase(rs, PHASE_SCAN, since);
+    }
+
+    xfree(buf);
+    bm_stream_free(stream);
+    return ret_val;
+}
+
+/* Chunks of input read by a separate thread ahead of the stream scan. */
+struct read_ahead {
+    int fd;
+    /* Counts the reads. */
+    struct run_stats *rs;
+    /* Ring of READ_AHEAD_CHUNKS chunks of STREAM_CHUNK_SIZE bytes. */
+    unsigned char *chunks;
+    /* Protects the fields below. */
+    pthread_mutex_t lock;
+    /* Signalled once a chunk is read or scanned. */
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    /* The amount of bytes in each chunk. The last chunk read
+       holds 0 at EOF, or -1 if the read failed. */
+    ssize_t sizes[READ_AHEAD_CHUNKS];
+    /* The value of errno after the failed read. */
+    int read_errno;
+    /* The number of chunks read and scanned so far. */
+    size_t nr_filled;
+    size_t nr_drained;
+    /* Set once the scan needs no more data. */
+    int stopped;
+};
+
+/* Fills the chunks of the ring one by one until EOF or an error,
+   waiting while all of them are full. A chunk is passed on as soon as
+   the read returns, so the scan doesn't wait for the slow writer
+   to fill the whole chunk. */
+static void *read_ahead_worker(void *arg)
 {
-    unsigned char scratch_mem[1024], *buf = NULL;
-    size_t bufsz = 0U;
+    struct read_ahead *ra = arg;
+
+    /* The thread may only be cancelled while it waits for the data. */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
     while (1) {
-        ssize_t nr_read = 0, nr_all_read = 0;
-        size_t new_bufsz, count = sizeof(scratch_mem);
+        unsigned char *chunk;
+        ssize_t nr_read;
+        size_t slot;
+        int read_errno;
+
+        pthread_mutex_lock(&ra->lock);
+        while (ra->nr_filled - ra->nr_drained == READ_AHEAD_CHUNKS &&
+               !ra->stopped)
+            pthread_cond_wait(&ra->drained, &ra->lock);
+        if (ra->stopped) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        slot = ra->nr_filled % READ_AHEAD_CHUNKS;
+        pthread_mutex_unlock(&ra->lock);
+
+        chunk = ra->chunks + slot * STREAM_CHUNK_SIZE;
 
-        while (count > 0U) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        do {
             errno = 0;
-            nr_read = read(STDIN_FILENO,
-                           scratch_mem + nr_all_read,
-                           count);
+            nr_read = read(ra->fd, chunk, STREAM_CHUNK_SIZE);
+        } while (nr_read < 0 && errno == EINTR);
+        read_errno = errno;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        ra->rs->nr_reads++;
+        if (nr_read > 0)
+            ra->rs->nr_bytes_read += (size_t) nr_read;
+
+        pthread_mutex_lock(&ra->lock);
+        ra->sizes[slot] = nr_read < 0 ? -1 : nr_read;
+        ra->read_errno = read_errno;
+        ra->nr_filled++;
+        pthread_cond_signal(&ra->filled);
+        pthread_mutex_unlock(&ra->lock);
+
+        if (nr_read <= 0)
+            break;
+    }
 
-            if (nr_read < 0 && errno == EINTR)
-                continue;
+    return NULL;
+}
 
-            if (nr_read <= 0)
-                break;
+/* Feeds data from @fd to the stream scan like scan_stream() does,
+   while a separate thread reads up to READ_AHEAD_CHUNKS chunks ahead.
+   Once @sink asks to stop, the reading thread is cancelled even if
+   it waits for the data which may never come, so the program exits
+   without draining the pipe. The data the stream holds back is scanned
+   once the writer stays silent for STREAM_FLUSH_DELAY milliseconds,
+   so the match it completes is reported without waiting for more.
+   If the thread can't be started, the input is read by the scan itself. */
+static int scan_pipelined(const struct bm_pattern *pat,
+                          int fd,
+                          struct bm_sink *sink,
+                          struct run_stats *rs)
+{
+    struct read_ahead ra;
+    struct bm_stream *stream;
+    pthread_t reader;
+    pthread_condattr_t attr;
+    size_t nr_all_read = 0U;
+    /* Whether the stream may hold back the data fed to it. */
+    int held_back = 0;
+    int ret_val = BM_NOT_FOUND;
+
+    memset(&ra, 0, sizeof(ra));
+    ra.fd = fd;
+    ra.rs = rs;
+    ra.chunks = xmalloc((size_t) READ_AHEAD_CHUNKS * STREAM_CHUNK_SIZE);
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ra.filled, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&ra.drained, NULL);
+
+    if (bm_stream_open(pat, sink, &stream) != BM_OK) {
+        fprintf(stderr, "Failed to allocate memory for the stream\n");
+        ret_val = BM_NO_MEM;
+        goto out;
+    }
 
-            if ((size_t) nr_read > count) {
-                /* Treat this unlikely condition as out-of-range error.
-                   Discard any possible data obtained from the last read. */
-                errno = ERANGE;
-                nr_read = -1;
-                break;
-            }
+    if (pthread_create(&reader, NULL, read_ahead_worker, &ra) != 0) {
+        bm_stream_free(stream);
+        ret_val = scan_stream(pat, fd, sink, rs);
+        goto out;
+    }
+
+    while (!sink->stopped) {
+        const unsigned char *chunk;
+        ssize_t size;
+        double since[2];
+        struct timespec deadline;
+        int ready;
+
+        begin_phase(rs, since);
 
-            count -= (size_t) nr_read;
-            nr_all_read += nr_read;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long) STREAM_FLUSH_DELAY * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&ra.lock);
+        while (ra.nr_filled == ra.nr_drained) {
+            if (!held_back)
+                pthread_cond_wait(&ra.filled, &ra.lock);
+            else if (pthread_cond_timedwait(&ra.filled,
+                                            &ra.lock,
+                                            &deadline) == ETIMEDOUT)
+                break;
+        }
+        ready = ra.nr_filled != ra.nr_drained;
+        size = ready ? ra.sizes[ra.nr_drained % READ_AHEAD_CHUNKS] : 0;
+        pthread_mutex_unlock(&ra.lock);
+
+        end_phase(rs, PHASE_INPUT, since);
+
+        /* The writer is silent, so the data held back by the stream
+           is scanned while the next read is awaited. */
+        if (!ready) {
+            begin_phase(rs, since);
+            if (bm_stream_flush(stream) == BM_FOUND)
+                ret_val = BM_FOUND;
+            end_phase(rs, PHASE_SCAN, since);
+
+            held_back = 0;
+            continue;
         }
 
-        if (nr_all_read == 0) {
-            /* We don't expect any errors.
-               Note: if we've managed to receive some data, discard any errors
-               from the last read. Assume that previous reads give us valid data. */
-            if (bufsz == 0U && nr_read == -1) {
+        chunk = ra.chunks +
+                (ra.nr_drained % READ_AHEAD_CHUNKS) * STREAM_CHUNK_SIZE;
+
+        begin_phase(rs, since);
+
+        if (size <= 0) {
+            if (size == -1 && nr_all_read == 0U) {
+                errno = ra.read_errno;
                 perror("I/O error");
-                return BM_IO_ERR;
+                ret_val = BM_IO_ERR;
+            } else if (bm_stream_finish(stream) == BM_FOUND) {
+                ret_val = BM_FOUND;
             }
 
+            end_phase(rs, PHASE_SCAN, since);
             break;
         }
 
-        new_bufsz = bufsz + (size_t) nr_all_read;
-        if (new_bufsz <= bufsz) {
-            fprintf(stderr,
-                    "I/O error: "
-                    "Overflow detected while re-allocating buffer\n");
-            xfree(buf);
-            return BM_IO_ERR;
-        }
+        nr_all_read += (size_t) size;
+
+        if (bm_feed(stream, chunk, (size_t) size) == BM_FOUND)
+            ret_val = BM_FOUND;
+        held_back = 1;
 
-        buf = xrealloc(buf, new_bufsz);
-        memcpy(buf + bufsz,
-               scratch_mem,
-               (size_t) nr_all_read);
-        bufsz = new_bufsz;
+        end_phase(rs, PHASE_SCAN, since);
+
+        /* The stream has copied the data, so the chunk may be refilled. */
+        pthread_mutex_lock(&ra.lock);
+        ra.nr_drained++;
+        pthread_cond_signal(&ra.drained);
+        pthread_mutex_unlock(&ra.lock);
     }
 
-    *pbuf = buf;
-    *pbufsz = bufsz;
-    return BM_OK;
+    pthread_mutex_lock(&ra.lock);
+    ra.stopped = 1;
+    pthread_cond_signal(&ra.drained);
+    pthread_mutex_unlock(&ra.lock);
+
+    pthread_cancel(reader);
+    pthread_join(reader, NULL);
+
+    bm_stream_free(stream);
+
+out:
+    xfree(ra.chunks);
+    pthread_cond_destroy(&ra.drained);
+    pthread_cond_destroy(&ra.filled);
+    pthread_mutex_destroy(&ra.lock);
+    return ret_val;
+}
+
+/* Keeps the matches found in a slice of the parallel scan
+   until all the preceding slices are done. */
+struct slice_matches {
+    struct bm_sink sink;
+    /* Offsets of the matches and indices of the matched patterns. */
+    size_t *pos;
+    size_t *members;
+    size_t nr_pos;
+    size_t capacity;
+    /* Stop the scan of the slice at the first match. */
+    int first_only;
+    /* The number of matches if they are just counted. */
+    size_t nr_counted;
+    /* Counters of the engine if the sink wants them. */
+    struct bm_stats stats;
+};
+
+static int collect_match(struct bm_sink *sink, size_t pos, size_t member)
+{
+    struct slice_matches *sm = (struct slice_matches *) sink;
+
+    if (sink->nr_counted != NULL) {
+        sm->nr_counted++;
+        return 0;
+    }
+
+    if (sm->nr_pos == sm->capacity) {
+        sm->capacity = sm->capacity != 0U ? sm->capacity * 2U : 16U;
+        sm->pos = xrealloc(sm->pos, sm->capacity * sizeof(*sm->pos));
+        sm->members = xrealloc(sm->members,
+                               sm->capacity * sizeof(*sm->members));
+    }
+
+    sm->pos[sm->nr_pos] = pos;
+    sm->members[sm->nr_pos] = member;
+    sm->nr_pos++;
+
+    return sm->first_only;
 }
 
-/* Tries to match pattern to bit substring starting
-   at specific offset in memcmp-style. */
-static int match(const struct bit_pattern *pat,
-                 const unsigned char *buf,
-                 size_t offset)
+/* State shared by threads of the parallel scan. */
+struct parallel_scan {
+    const struct bm_pattern *pat;
+    const unsigned char *buf;
+    /* The amount of bits in the buffer. */
+    size_t end;
+    size_t nr_slices;
+    /* Stop the scan of each slice at its first match. */
+    int first_only;
+    /* Protects the fields below. */
+    pthread_mutex_t lock;
+    /* Receives the matches of all slices in order. */
+    struct bm_sink *sink;
+    /* Matches of the slices which are done but not passed to the sink. */
+    struct slice_matches *slices;
+    unsigned char *done;
+    /* Index of the next slice to be scanned. */
+    size_t next_slice;
+    /* Index of the next slice to pass its matches to the sink. */
+    size_t next_flushed;
+    /* The slices starting from this one needn't be scanned. */
+    size_t limit;
+    /* Whether the sink has received any matches. */
+    int found;
+};
+
+/* Passes the matches of the slices which are done to the sink
+   in the order of slices. Must be called with the lock held. */
+static void flush_slices(struct parallel_scan *ps)
 {
-    size_t pat_offset, count;
+    while (ps->next_flushed < ps->limit && ps->done[ps->next_flushed]) {
+        struct slice_matches *sm = &ps->slices[ps->next_flushed];
+        size_t i;
+
+        if (sm->nr_counted != 0U) {
+            ps->found = 1;
+            *ps->sink->nr_counted += sm->nr_counted;
+        }
+
+        for (i = 0U; i < sm->nr_pos; i++) {
+            ps->found = 1;
+
+            if (ps->sink->report(ps->sink, sm->pos[i], sm->members[i])) {
+                /* No other slice is needed. */
+                ps->sink->stopped = 1;
+                ps->limit = ps->next_flushed + 1U;
+                break;
+            }
+        }
 
-    for (pat_offset = 0U;
-         pat_offset < pat->nr_bits;
-         offset += count, pat_offset += count) {
-        size_t nr_remained;
-        unsigned int b1, b2;
+        xfree(sm->pos);
+        xfree(sm->members);
+        sm->pos = NULL;
+        sm->members = NULL;
+        ps->next_flushed++;
+    }
+}
 
-        nr_remained = pat->nr_bits - pat_offset;
-        count = nr_remained < 8U ? nr_remained : 8U;
+/* Scans the slices one by one in increasing order until
+   there are no more slices preceding the one where the scan stopped. */
+static void *scan_worker(void *arg)
+{
+    struct parallel_scan *ps = arg;
+    const size_t slice_bits = (size_t) THREAD_SLICE_SIZE * 8U;
+    const size_t max_bits = bm_max_bits(ps->pat);
 
-        b1 = extract_bitfield(buf,
-                              offset,
-                              count);
-        b2 = extract_bitfield(pat->buf,
-                              pat_offset,
-                              count);
+    while (1) {
+        struct slice_matches sm;
+        size_t slice, offset, end;
 
-        if (b1 != b2)
-            return BM_NOT_FOUND;
+        pthread_mutex_lock(&ps->lock);
+        slice = ps->next_slice;
+        if (slice >= ps->limit) {
+            pthread_mutex_unlock(&ps->lock);
+            break;
+        }
+        ps->next_slice++;
+        pthread_mutex_unlock(&ps->lock);
+
+        /* The slice holds the starting bits of matches.
+           A match starting at its last bit extends (nr_bits - 1) bits
+           past the slice. */
+        offset = slice * slice_bits;
+        end = ps->end - offset > slice_bits + max_bits - 1U ?
+              offset + slice_bits + max_bits - 1U :
+              ps->end;
+
+        memset(&sm, 0, sizeof(sm));
+        sm.sink.report = collect_match;
+        sm.first_only = ps->first_only;
+        /* Keep counting the matches if the sink wants just their number. */
+        if (ps->sink->nr_counted != NULL)
+            sm.sink.nr_counted = &sm.nr_counted;
+        if (ps->sink->stats != NULL)
+            sm.sink.stats = &sm.stats;
+        /* The matches ending within the overlap with the preceding slice
+           are reported by its scan. */
+        if (slice != 0U)
+            sm.sink.skip_until = offset + max_bits - 1U;
+
+        bm_scan(ps->pat, ps->buf, offset, end, &sm.sink);
+
+        pthread_mutex_lock(&ps->lock);
+        if (ps->sink->stats != NULL) {
+            ps->sink->stats->nr_verified += sm.stats.nr_verified;
+            ps->sink->stats->nr_rejected += sm.stats.nr_rejected;
+        }
+        ps->slices[slice] = sm;
+        ps->done[slice] = 1U;
+        /* The following slices can't contain the first match. */
+        if (ps->first_only && sm.nr_pos != 0U && slice < ps->limit)
+            ps->limit = slice + 1U;
+        flush_slices(ps);
+        pthread_mutex_unlock(&ps->lock);
     }
 
-    return BM_FOUND;
+    return NULL;
 }
 
-/* Locate the first occurrence of the pattern
-   by using Rabin–Karp algorithm. Hashes are computed fast
-   because we use rolling hash function.
-
-   Let BkBk-1...B2B1B0 be the bit string.
-   The hash function F is computed as follows:
-     F = (Bk * (2 ** k) + ... + B2 * (2 ** 2) + B1 * 2 + B0) mod P
-   where P is a prime number.
-   In order to eliminate the most significant addend
-   we use pre-computed value that is -(2 ** k) == P - (2 ** k) mod P.
-   So if Bk == 0 we have nothing to do since the largest power
-   is nullified. Else Bk == 1 and we add pre-computed value thus
-   cancelling the effect of the largest exponent out.
-*/
-static int scan(const struct bit_pattern *pat,
-                const unsigned char *buf,
-                size_t bufsz)
-{
-    unsigned int hash = 0U;
-    size_t offset, count;
-
-    /* Compute hash value of the first K (=number of bits in the pattern)
-       data bits. */
-    for (offset = 0U;
-         offset < pat->nr_bits;
-         offset += count) {
-        size_t nr_remained;
-
-        nr_remained = pat->nr_bits - offset;
-        count = nr_remained < 8U ? nr_remained : 8U;
-
-        hash = ((hash << count) +
-                extract_bitfield(buf, offset, count)) % PRIME_NUM;
-    }
-
-    for (bufsz *= 8U;
-         offset < bufsz;
-         offset++) {
-        /* Try to match the current hash value. */
-        if (hash == pat->hash &&
-            match(pat, buf, offset - pat->nr_bits) == BM_FOUND)
-            return BM_FOUND;
-
-        /* Do we need to nullify the effect of the largest exponent
-           on hash value? */
-        if (extract_bitfield(buf, offset - pat->nr_bits, 1) == 1U)
-            hash = (hash + pat->rnum) % PRIME_NUM;
-
-        hash = ((hash << 1U) +
-                extract_bitfield(buf, offset, 1)) % PRIME_NUM;
-    }
-
-    /* The last possible match. */
-    if (hash == pat->hash &&
-        match(pat, buf, offset - pat->nr_bits) == BM_FOUND)
-        return BM_FOUND;
+/* Scans bit range [0, @end) with @nr_threads threads including
+   the calling one. The input is split into slices of THREAD_SLICE_SIZE bytes
+   which are handed out to the threads in order. The matches of each slice
+   are kept until the preceding slices are done, so @sink receives them
+   in order. Once @sink asks to stop, the following slices are skipped.
+   If some threads can't be started, the scan proceeds with fewer threads.
+   @first_only tells that @sink stops at the first match. In that case
+   the slices following the one with a match are skipped right away. */
+static int scan_parallel(const struct bm_pattern *pat,
+                         const unsigned char *buf,
+                         size_t end,
+                         unsigned int nr_threads,
+                         struct bm_sink *sink,
+                         int first_only)
+{
+    struct parallel_scan ps;
+    pthread_t *threads;
+    unsigned int i, nr_started;
+    size_t slice;
+
+    assert(end >= bm_min_bits(pat));
+
+    memset(&ps, 0, sizeof(ps));
+    ps.pat = pat;
+    ps.buf = buf;
+    ps.end = end;
+    /* The input shorter than the longest pattern of the set
+       makes a single slice. */
+    ps.nr_slices = 1U;
+    if (end >= bm_max_bits(pat))
+        ps.nr_slices += (end - bm_max_bits(pat)) /
+                        ((size_t) THREAD_SLICE_SIZE * 8U);
+    ps.first_only = first_only;
+    ps.sink = sink;
+    ps.slices = xmalloc(ps.nr_slices * sizeof(*ps.slices));
+    ps.done = xmalloc(ps.nr_slices);
+    memset(ps.done, 0, ps.nr_slices);
+    ps.limit = ps.nr_slices;
+    pthread_mutex_init(&ps.lock, NULL);
+
+    if (nr_threads > ps.nr_slices)
+        nr_threads = (unsigned int) ps.nr_slices;
+
+    threads = xmalloc(nr_threads * sizeof(*threads));
+
+    for (nr_started = 0U; nr_started + 1U < nr_threads; nr_started++) {
+        if (pthread_create(&threads[nr_started], NULL, scan_worker, &ps) != 0)
+            break;
+    }
+
+    scan_worker(&ps);
+
+    for (i = 0U; i < nr_started; i++)
+        pthread_join(threads[i], NULL);
 
-    return BM_NOT_FOUND;
+    /* Slices which were done after the scan had stopped. */
+    for (slice = 0U; slice < ps.nr_slices; slice++) {
+        if (ps.done[slice]) {
+            xfree(ps.slices[slice].pos);
+            xfree(ps.slices[slice].members);
+        }
+    }
+
+    xfree(threads);
+    xfree(ps.done);
+    xfree(ps.slices);
+    pthread_mutex_destroy(&ps.lock);
+
+    return ps.found ? BM_FOUND : BM_NOT_FOUND;
 }
 
-int main(int argc, char *argv[])
+/* Loads the whole data from @fd and scans it with @nr_threads threads.
+   @first_only tells that @sink stops at the first match. */
+static int scan_input(const struct bm_pattern *pat,
+                      int fd,
+                      unsigned int nr_threads,
+                      struct bm_sink *sink,
+                      int first_only,
+                      struct run_stats *rs)
 {
-    struct bit_pattern pat;
     unsigned char *buf;
     size_t bufsz;
-    int ret_val;
-
-    if (argc != 3) {
-        print_usage();
-        return BM_USAGE_ERR;
-    }
+    int ret_val, mapped;
+    double since[2];
 
-    if ((ret_val = get_pattern(argv[1], argv[2], &pat)) != BM_OK) {
-        return ret_val;
-    }
+    begin_phase(rs, since);
+    ret_val = load_input(fd, &buf, &bufsz, &mapped, rs);
+    end_phase(rs, PHASE_INPUT, since);
 
-    if ((ret_val = consume_stdin(&buf, &bufsz)) != BM_OK) {
-        xfree(pat.buf);
+    if (ret_val != BM_OK)
         return ret_val;
-    }
 
     if (bufsz > SIZE_MAX / 8U) {
         fprintf(stderr,
                 "I/O error: "
                 "Input buffer is too large\n");
-        xfree(buf);
-        xfree(pat.buf);
+        release_input(buf, bufsz, mapped);
         return BM_IO_ERR;
     }
 
+    begin_phase(rs, since);
+
     /* Does scanning make sense? */
-    if (bufsz * 8U >= pat.nr_bits)
-        ret_val = scan(&pat, buf, bufsz);
-    else
+    if (bufsz * 8U < bm_min_bits(pat))
         ret_val = BM_NOT_FOUND;
+    else if (nr_threads > 1U)
+        ret_val = scan_parallel(pat, buf, bufsz * 8U, nr_threads,
+                                sink, first_only);
+    else
+        ret_val = bm_scan(pat, buf, 0U, bufsz * 8U, sink);
 
-    xfree(buf);
-    xfree(pat.buf);
+    end_phase(rs, PHASE_SCAN, since);
+
+    release_input(buf, bufsz, mapped);
+    return ret_val;
+}
+
+/* Adds the counters of @from to @to. */
+static void add_stats(struct run_stats *to, const struct run_stats *from)
+{
+    to->nr_bytes_read += from->nr_bytes_read;
+    to->nr_reads += from->nr_reads;
+    to->nr_bytes_mapped += from->nr_bytes_mapped;
+    to->nr_reallocs += from->nr_reallocs;
+    to->engine.nr_verified += from->engine.nr_verified;
+    to->engine.nr_rejected += from->engine.nr_rejected;
+}
+
+/* A file scanned by the pool of threads. */
+struct file_scan {
+    char *path;
+    /* The output of the scan kept until the preceding files are done. */
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+    /* Whether the output goes to stdout instead. */
+    int direct;
+    int ret_val;
+};
+
+/* State shared by threads scanning the files. */
+struct file_pool {
+    const struct bm_pattern *pat;
+    /* The printer each file gets a copy of, or NULL if just the names
+       of the files with a match are printed. */
+    const struct match_printer *printer;
+    /* Scan each file in chunks instead of loading it whole. */
+    int streaming;
+    struct file_scan *files;
+    size_t nr_files;
+    size_t capacity;
+    /* Protects the fields below. */
+    pthread_mutex_t lock;
+    unsigned char *done;
+    /* Index of the next file to be scanned. */
+    size_t next_file;
+    /* Index of the next file to print its output. */
+    size_t next_flushed;
+    /* Signalled once next_flushed advances. */
+    pthread_cond_t flushed;
+    /* Whether any file has a match. */
+    int found;
+    /* Status of the first file which failed to be scanned, or BM_OK. */
+    int error;
+    /* Receives the counters of all threads. */
+    struct run_stats *stats;
+};
+
+/* Appends the file at @path to the files to be scanned. */
+static void add_file(struct file_pool *fp, const char *path)
+{
+    struct file_scan *fs;
+    size_t len;
+
+    if (fp->nr_files == fp->capacity) {
+        fp->capacity = fp->capacity != 0U ? fp->capacity * 2U : 16U;
+        fp->files = xrealloc(fp->files, fp->capacity * sizeof(*fp->files));
+    }
+
+    fs = &fp->files[fp->nr_files++];
+    memset(fs, 0, sizeof(*fs));
+    len = strlen(path) + 1U;
+    fs->path = xmalloc(len);
+    memcpy(fs->path, path, len);
+}
+
+/* Adds the file at @path to the files to be scanned. Directories are
+   walked down if @recursive, taking the regular files found there.
+   Symbolic links are followed only for the files given on
+   the command line (@top), so the walk never loops. */
+static int collect_files(struct file_pool *fp,
+                         const char *path,
+                         int recursive,
+                         int top)
+{
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+    int ret_val = BM_OK;
+
+    if ((top ? stat(path, &st) : lstat(path, &st)) != 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                path,
+                strerror(errno));
+        return BM_IO_ERR;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        /* Devices and pipes met in the walk may block forever. */
+        if (top || S_ISREG(st.st_mode))
+            add_file(fp, path);
+        return BM_OK;
+    }
+
+    if (!recursive) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to read %s: %s\n",
+                path,
+                strerror(EISDIR));
+        return BM_IO_ERR;
+    }
+
+    if ((dir = opendir(path)) == NULL) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                path,
+                strerror(errno));
+        return BM_IO_ERR;
+    }
+
+    while (1) {
+        char *child;
+        size_t len, name_len;
+        int child_ret_val;
+
+        errno = 0;
+        if ((entry = readdir(dir)) == NULL) {
+            if (errno != 0) {
+                fprintf(stderr,
+                        "I/O error: "
+                        "Failed to read %s: %s\n",
+                        path,
+                        strerror(errno));
+                ret_val = BM_IO_ERR;
+            }
+
+            break;
+        }
+
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        len = strlen(path);
+        name_len = strlen(entry->d_name);
+        child = xmalloc(len + name_len + 2U);
+        memcpy(child, path, len);
+        /* The path may already end with the separator. */
+        if (len == 0U || path[len - 1U] != '/')
+            child[len++] = '/';
+        memcpy(child + len, entry->d_name, name_len + 1U);
+
+        child_ret_val = collect_files(fp, child, recursive, 0);
+        if (child_ret_val != BM_OK && ret_val == BM_OK)
+            ret_val = child_ret_val;
+
+        xfree(child);
+    }
+
+    closedir(dir);
+    return ret_val;
+}
+
+/* The stream receiving the output of a file of the pool. */
+struct file_output {
+    struct file_pool *fp;
+    size_t file;
+};
+
+/* Keeps the output of the file in memory, see FILE_OUTPUT_MAX_SIZE. */
+static ssize_t write_file_output(void *cookie, const char *buf, size_t size)
+{
+    struct file_output *fo = cookie;
+    struct file_pool *fp = fo->fp;
+    struct file_scan *fs = &fp->files[fo->file];
+
+    if (!fs->direct && fs->output_size + size > FILE_OUTPUT_MAX_SIZE) {
+        /* Once the file comes next, no other thread prints
+           until it is done. */
+        pthread_mutex_lock(&fp->lock);
+        while (fp->next_flushed != fo->file)
+            pthread_cond_wait(&fp->flushed, &fp->lock);
+        pthread_mutex_unlock(&fp->lock);
+
+        fwrite(fs->output, 1U, fs->output_size, stdout);
+        xfree(fs->output);
+        fs->output = NULL;
+        fs->output_size = 0U;
+        fs->direct = 1;
+    }
+
+    if (fs->direct)
+        return (ssize_t) fwrite(buf, 1U, size, stdout);
+
+    if (fs->output_size + size > fs->output_capacity) {
+        fs->output_capacity = fs->output_capacity != 0U ?
+                              fs->output_capacity * 2U : 4096U;
+        if (fs->output_capacity < fs->output_size + size)
+            fs->output_capacity = fs->output_size + size;
+        fs->output = xrealloc(fs->output, fs->output_capacity);
+    }
+
+    memcpy(fs->output + fs->output_size, buf, size);
+    fs->output_size += size;
+
+    return (ssize_t) size;
+}
+
+/* Scans the file @file of the pool with its own sink. The output is kept
+   in memory until it can be printed. The counters are put to @rs. */
+static void scan_file(struct file_pool *fp,
+                      size_t file,
+                      struct run_stats *rs)
+{
+    static const cookie_io_functions_t output_functions = {
+        NULL, write_file_output, NULL, NULL
+    };
+    struct file_scan *fs = &fp->files[file];
+    struct file_output fo;
+    struct match_printer printer;
+    struct bm_sink first_match, *sink = &first_match;
+    FILE *out;
+    int fd;
+
+    if ((fd = open(fs->path, O_RDONLY)) < 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                fs->path,
+                strerror(errno));
+        fs->ret_val = BM_IO_ERR;
+        return;
+    }
+
+    fo.fp = fp;
+    fo.file = file;
+    if ((out = fopencookie(&fo, "w", output_functions)) == NULL) {
+        fprintf(stderr,
+                "Failed to allocate memory for the output of %s\n",
+                fs->path);
+        close(fd);
+        fs->ret_val = BM_NO_MEM;
+        return;
+    }
+
+    memset(&first_match, 0, sizeof(first_match));
+    first_match.report = stop_at_first;
+
+    if (fp->printer != NULL) {
+        printer = *fp->printer;
+        printer.out = out;
+        printer.name = fs->path;
+        printer.next = 0U;
+        printer.nr_matches = 0U;
+        printer.sink.nr_counted = printer.count_only &&
+                                  !printer.non_overlapping ?
+                                  &printer.nr_matches : NULL;
+        sink = &printer.sink;
+    }
+
+    sink->stats = fp->stats->enabled ? &rs->engine : NULL;
+
+    if (fp->streaming)
+        fs->ret_val = scan_stream(fp->pat, fd, sink, rs);
+    else
+        fs->ret_val = scan_input(fp->pat, fd, 1U, sink, 0, rs);
+
+    if (fp->printer == NULL && fs->ret_val == BM_FOUND)
+        fprintf(out, "%s\n", fs->path);
+    else if (fp->printer != NULL && printer.count_only &&
+             (fs->ret_val == BM_FOUND || fs->ret_val == BM_NOT_FOUND))
+        fprintf(out, "%s:%zu\n", fs->path, printer.nr_matches);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr,
+                "Failed to allocate memory for the output of %s\n",
+                fs->path);
+        fs->ret_val = BM_NO_MEM;
+    }
+
+    close(fd);
+}
+
+/* Prints the output of the files which are done in the order of files.
+   Must be called with the lock held. */
+static void flush_files(struct file_pool *fp)
+{
+    while (fp->next_flushed < fp->nr_files && fp->done[fp->next_flushed]) {
+        struct file_scan *fs = &fp->files[fp->next_flushed];
+
+        if (fs->output_size != 0U)
+            fwrite(fs->output, 1U, fs->output_size, stdout);
+
+        if (fs->ret_val == BM_FOUND)
+            fp->found = 1;
+        else if (fs->ret_val != BM_NOT_FOUND && fp->error == BM_OK)
+            fp->error = fs->ret_val;
+
+        xfree(fs->output);
+        fs->output = NULL;
+        fp->next_flushed++;
+        pthread_cond_broadcast(&fp->flushed);
+    }
+}
+
+/* Scans the files one by one until there are no more files. */
+static void *file_worker(void *arg)
+{
+    struct file_pool *fp = arg;
+    struct run_stats rs;
+
+    /* The clocks of the threads aren't read, the whole pool is timed. */
+    memset(&rs, 0, sizeof(rs));
+
+    while (1) {
+        size_t file;
+
+        pthread_mutex_lock(&fp->lock);
+        file = fp->next_file;
+        if (file >= fp->nr_files) {
+            pthread_mutex_unlock(&fp->lock);
+            break;
+        }
+        fp->next_file++;
+        pthread_mutex_unlock(&fp->lock);
+
+        scan_file(fp, file, &rs);
+
+        pthread_mutex_lock(&fp->lock);
+        fp->done[file] = 1U;
+        flush_files(fp);
+        pthread_mutex_unlock(&fp->lock);
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    add_stats(fp->stats, &rs);
+    pthread_mutex_unlock(&fp->lock);
+
+    return NULL;
+}
+
+/* Scans the files at @paths with @nr_threads threads including
+   the calling one. Directories are walked down if @recursive.
+   Each thread takes the next file to scan as soon as it is done with
+   the previous one, so a large file doesn't hold the others up.
+   The output of each file is printed once the preceding files are done,
+   so it comes in the order of the files. The long output is printed
+   as soon as the preceding files are printed, see FILE_OUTPUT_MAX_SIZE.
+   @printer is copied for each file, or NULL if just the names
+   of the files with a match are printed.
+   If some threads can't be started, the scan proceeds with fewer threads.
+   Returns BM_FOUND if any file has a match, BM_NOT_FOUND if none has,
+   or the status of the first file which failed to be scanned. */
+static int scan_files(const struct bm_pattern *pat,
+                      char *const *paths,
+                      size_t nr_paths,
+                      int recursive,
+                      unsigned int nr_threads,
+                      int streaming,
+                      const struct match_printer *printer,
+                      struct run_stats *stats)
+{
+    struct file_pool fp;
+    pthread_t *threads;
+    unsigned int i, nr_started;
+    size_t file;
+    int ret_val;
+    double since[2];
+
+    memset(&fp, 0, sizeof(fp));
+    fp.pat = pat;
+    fp.printer = printer;
+    fp.streaming = streaming;
+    fp.stats = stats;
+    fp.error = BM_OK;
+
+    begin_phase(stats, since);
+
+    for (file = 0U; file < nr_paths; file++) {
+        ret_val = collect_files(&fp, paths[file], recursive, 1);
+        if (ret_val != BM_OK && fp.error == BM_OK)
+            fp.error = ret_val;
+    }
+
+    end_phase(stats, PHASE_INPUT, since);
+
+    if (fp.nr_files == 0U)
+        return fp.error != BM_OK ? fp.error : BM_NOT_FOUND;
+
+    fp.done = xmalloc(fp.nr_files);
+    memset(fp.done, 0, fp.nr_files);
+    pthread_mutex_init(&fp.lock, NULL);
+    pthread_cond_init(&fp.flushed, NULL);
+
+    if (nr_threads > fp.nr_files)
+        nr_threads = (unsigned int) fp.nr_files;
+
+    threads = xmalloc(nr_threads * sizeof(*threads));
+
+    begin_phase(stats, since);
+
+    for (nr_started = 0U; nr_started + 1U < nr_threads; nr_started++) {
+        if (pthread_create(&threads[nr_started], NULL, file_worker, &fp) != 0)
+            break;
+    }
+
+    file_worker(&fp);
+
+    for (i = 0U; i < nr_started; i++)
+        pthread_join(threads[i], NULL);
+
+    end_phase(stats, PHASE_SCAN, since);
+
+    for (file = 0U; file < fp.nr_files; file++)
+        xfree(fp.files[file].path);
+
+    xfree(threads);
+    xfree(fp.files);
+    xfree(fp.done);
+    pthread_cond_destroy(&fp.flushed);
+    pthread_mutex_destroy(&fp.lock);
+
+    if (fp.error != BM_OK)
+        return fp.error;
+
+    return fp.found ? BM_FOUND : BM_NOT_FOUND;
+}
+
+/* Both kinds of the index files start with this header.
+   The gram index goes on with the offsets of the posting lists of all grams
+   relative to the first list, one more offset telling the end of the last
+   list, and the lists themselves. The block filter goes on with the filters
+   of the blocks in order. The numbers are in the byte order of the machine
+   which built the index. */
+struct index_header {
+    char magic[8];
+    uint64_t gram_bits;
+    /* The size of the blocks and of their filters in bits
+       for the block filter, 0 for the gram index. */
+    uint64_t block_size;
+    uint64_t filter_bits;
+    /* Size and modification time of the indexed file. */
+    uint64_t data_size;
+    int64_t data_mtime;
+    int64_t data_mtime_nsec;
+};
+
+static const char index_magic[8] = "BMINDEX2";
+static const char block_filter_magic[8] = "BMBLOCK1";
+
+/* The index mapped to memory. */
+struct bit_index {
+    void *addr;
+    size_t size;
+    unsigned int gram_bits;
+    /* The gram index. */
+    const uint64_t *offsets;
+    const unsigned char *postings;
+    size_t postings_size;
+    /* The filters of the blocks, or NULL for the gram index. */
+    const unsigned char *filters;
+    size_t nr_blocks;
+};
+
+/* Returns the number of bytes put_varint() puts for @val. */
+static size_t varint_size(uint64_t val)
+{
+    size_t size = 1U;
+
+    while (val >= 0x80U) {
+        val >>= 7U;
+        size++;
+    }
+
+    return size;
+}
+
+/* Puts @val to @out in groups of 7 bits, least significant first.
+   The high bit of each byte tells whether more groups follow.
+   Returns the number of bytes put. */
+static size_t put_varint(unsigned char *out, uint64_t val)
+{
+    size_t size = 0U;
+
+    while (val >= 0x80U) {
+        out[size++] = (unsigned char) (val | 0x80U);
+        val >>= 7U;
+    }
+
+    out[size++] = (unsigned char) val;
+    return size;
+}
+
+/* Gets the value put by put_varint() from @in, not reading past @end.
+   Returns the position following the value, or NULL if it is cut off. */
+static const unsigned char *get_varint(const unsigned char *in,
+                                       const unsigned char *end,
+                                       uint64_t *pval)
+{
+    uint64_t val = 0U;
+    unsigned int shift = 0U;
+
+    while (in < end && shift < 64U) {
+        unsigned char byte = *in++;
+
+        val |= (uint64_t) (byte & 0x7FU) << shift;
+        if (!(byte & 0x80U)) {
+            *pval = val;
+            return in;
+        }
+
+        shift += 7U;
+    }
+
+    return NULL;
+}
+
+/* Returns the gram of @gram_bits bits starting at @pos byte of @buf. */
+static size_t gram_at(const unsigned char *buf,
+                      size_t pos,
+                      unsigned int gram_bits)
+{
+    size_t gram = 0U;
+    unsigned int i;
+
+    for (i = 0U; i < gram_bits / 8U; i++)
+        gram = gram << 8U | buf[pos + i];
+
+    return gram;
+}
+
+/* Fills the header of the index of the file described by @st. */
+static void init_index_header(struct index_header *hdr,
+                              const char *magic,
+                              unsigned int gram_bits,
+                              const struct stat *st)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, magic, sizeof(hdr->magic));
+    hdr->gram_bits = gram_bits;
+    hdr->data_size = (uint64_t) st->st_size;
+    hdr->data_mtime = (int64_t) st->st_mtim.tv_sec;
+    hdr->data_mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+}
+
+/* Creates the index file at @index_path of @index_size bytes and maps it
+   to memory for writing. The space is allocated on disk beforehand,
+   so running out of it is reported here rather than by a signal
+   while the index is written. */
+static int create_index(const char *index_path,
+                        size_t index_size,
+                        unsigned char **paddr)
+{
+    void *addr = MAP_FAILED;
+    int index_fd, err = 0;
+
+    if ((index_fd = open(index_path, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+        err = errno;
+    else if ((err = posix_fallocate(index_fd, 0, (off_t) index_size)) == 0 &&
+             (addr = mmap(NULL, index_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, index_fd, 0)) == MAP_FAILED)
+        err = errno;
+
+    if (index_fd >= 0)
+        close(index_fd);
+
+    if (err != 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to write %s: %s\n",
+                index_path,
+                strerror(err));
+        if (index_fd >= 0)
+            unlink(index_path);
+        return BM_IO_ERR;
+    }
+
+    *paddr = addr;
+    return BM_OK;
+}
+
+/* Builds the index of the grams of @gram_bits bits starting at each byte
+   of @bufsz bytes of @buf, the data of the file described by @st,
+   and writes it to @index_path.
+   The posting list of each gram holds the offsets of the bytes it starts at
+   in increasing order, each of them being put as the difference from
+   the previous one. The lists are counted by the first pass over the data,
+   so the index file is written in place by the second one. */
+static int build_index(const unsigned char *buf,
+                       size_t bufsz,
+                       const struct stat *st,
+                       const char *index_path,
+                       unsigned int gram_bits)
+{
+    struct index_header hdr;
+    unsigned char *addr, *postings;
+    uint64_t *next, *last, total = 0U;
+    size_t pos, nr_pos, gram, index_size;
+    const size_t nr_grams = (size_t) 1U << gram_bits;
+    const size_t table_size = (nr_grams + 1U) * sizeof(uint64_t);
+    int ret_val;
+
+    nr_pos = bufsz >= gram_bits / 8U ? bufsz - gram_bits / 8U + 1U : 0U;
+
+    /* The first pass tells the size of each list. */
+    next = xmalloc(table_size);
+    last = xmalloc(nr_grams * sizeof(*last));
+    memset(next, 0, table_size);
+    memset(last, 0, nr_grams * sizeof(*last));
+
+    for (pos = 0U; pos < nr_pos; pos++) {
+        gram = gram_at(buf, pos, gram_bits);
+        next[gram] += varint_size(pos - last[gram]);
+        last[gram] = pos;
+    }
+
+    for (gram = 0U; gram <= nr_grams; gram++) {
+        uint64_t size = next[gram];
+
+        next[gram] = total;
+        total += size;
+    }
+
+    index_size = sizeof(hdr) + table_size + (size_t) total;
+    init_index_header(&hdr, index_magic, gram_bits, st);
+
+    if ((ret_val = create_index(index_path, index_size, &addr)) == BM_OK) {
+        memcpy(addr, &hdr, sizeof(hdr));
+        memcpy(addr + sizeof(hdr), next, table_size);
+
+        /* The second pass puts the offsets to the lists. */
+        postings = addr + sizeof(hdr) + table_size;
+        memset(last, 0, nr_grams * sizeof(*last));
+
+        for (pos = 0U; pos < nr_pos; pos++) {
+            gram = gram_at(buf, pos, gram_bits);
+            next[gram] += put_varint(postings + next[gram],
+                                     pos - last[gram]);
+            last[gram] = pos;
+        }
+
+        munmap(addr, index_size);
+    }
+
+    xfree(last);
+    xfree(next);
+    return ret_val;
+}
+
+/* Puts the bits of the Bloom filter telling that the block
+   may contain @gram of 16 bits to @bits. */
+static void filter_bits_of(size_t gram, size_t bits[2])
+{
+    bits[0] = ((uint32_t) gram * 2654435761U >> 16) % BLOCK_FILTER_BITS;
+    bits[1] = ((uint32_t) gram * 2246822507U >> 16) % BLOCK_FILTER_BITS;
+}
+
+/* Builds the block filter of @bufsz bytes of @buf, the data of the file
+   described by @st, and writes it to @index_path.
+   The filter of each block of BLOCK_FILTER_SIZE bytes is the Bloom filter
+   of the grams of 16 bits starting at any bit of the block. The grams
+   of the block are collected first, so each of them is hashed once. */
+static int build_block_filter(const unsigned char *buf,
+                              size_t bufsz,
+                              const struct stat *st,
+                              const char *index_path)
+{
+    struct index_header hdr;
+    unsigned char *addr, *filter, *seen;
+    const size_t filter_size = BLOCK_FILTER_BITS / 8U;
+    size_t nr_blocks, block, pos, end, gram, index_size;
+    int ret_val;
+
+    nr_blocks = (bufsz + BLOCK_FILTER_SIZE - 1U) / BLOCK_FILTER_SIZE;
+    index_size = sizeof(hdr) + nr_blocks * filter_size;
+
+    init_index_header(&hdr, block_filter_magic, 16U, st);
+    hdr.block_size = BLOCK_FILTER_SIZE;
+    hdr.filter_bits = BLOCK_FILTER_BITS;
+
+    if ((ret_val = create_index(index_path, index_size, &addr)) != BM_OK)
+        return ret_val;
+
+    memcpy(addr, &hdr, sizeof(hdr));
+    filter = addr + sizeof(hdr);
+    seen = xmalloc(65536U / 8U);
+
+    for (block = 0U; block < nr_blocks; block++, filter += filter_size) {
+        memset(seen, 0, 65536U / 8U);
+        memset(filter, 0, filter_size);
+
+        pos = block * BLOCK_FILTER_SIZE;
+        end = bufsz - pos > BLOCK_FILTER_SIZE ?
+              pos + BLOCK_FILTER_SIZE : bufsz;
+
+        /* The grams starting at the last bytes of the data
+           are cut off. */
+        for (; pos < end; pos++) {
+            uint32_t window = (uint32_t) buf[pos] << 16U;
+            unsigned int shift, nr_shifts = 8U;
+
+            if (pos + 1U < bufsz)
+                window |= (uint32_t) buf[pos + 1U] << 8U;
+            else
+                nr_shifts = 0U;
+
+            if (pos + 2U < bufsz)
+                window |= buf[pos + 2U];
+            else if (nr_shifts != 0U)
+                nr_shifts = 1U;
+
+            for (shift = 0U; shift < nr_shifts; shift++) {
+                gram = window >> (8U - shift) & 0xFFFFU;
+                seen[gram / 8U] |= 1U << gram % 8U;
+            }
+        }
+
+        for (gram = 0U; gram < 65536U; gram++) {
+            size_t bits[2];
+
+            if (!(seen[gram / 8U] & 1U << gram % 8U))
+                continue;
+
+            filter_bits_of(gram, bits);
+            filter[bits[0] / 8U] |= 1U << bits[0] % 8U;
+            filter[bits[1] / 8U] |= 1U << bits[1] % 8U;
+        }
+    }
+
+    xfree(seen);
+    munmap(addr, index_size);
+    return BM_OK;
+}
+
+/* Maps the index at @index_path to memory and makes sure
+   it is the index of the file @fd as it is now.
+   Both the gram index and the block filter are accepted. */
+static int open_index(const char *index_path, int fd, struct bit_index *idx)
+{
+    struct index_header hdr;
+    struct stat st, data_st;
+    size_t table_size, gram;
+    int index_fd;
+    const char *reason = NULL;
+
+    memset(idx, 0, sizeof(*idx));
+
+    if ((index_fd = open(index_path, O_RDONLY)) < 0 ||
+        fstat(index_fd, &st) != 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                index_path,
+                strerror(errno));
+        if (index_fd >= 0)
+            close(index_fd);
+        return BM_IO_ERR;
+    }
+
+    if ((uintmax_t) st.st_size < sizeof(hdr) ||
+        (uintmax_t) st.st_size > SIZE_MAX) {
+        close(index_fd);
+        reason = "Not an index";
+        goto invalid;
+    }
+
+    idx->size = (size_t) st.st_size;
+    idx->addr = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+
+    if (idx->addr == MAP_FAILED) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to map %s: %s\n",
+                index_path,
+                strerror(errno));
+        return BM_IO_ERR;
+    }
+
+    memcpy(&hdr, idx->addr, sizeof(hdr));
+
+    if (memcmp(hdr.magic, block_filter_magic, sizeof(hdr.magic)) == 0) {
+        if (hdr.gram_bits != 16U ||
+            hdr.block_size != BLOCK_FILTER_SIZE ||
+            hdr.filter_bits != BLOCK_FILTER_BITS) {
+            reason = "The block filter is built with other parameters";
+            goto unmap;
+        }
+
+        idx->gram_bits = 16U;
+        idx->filters = (const unsigned char *) idx->addr + sizeof(hdr);
+        idx->nr_blocks = (size_t) ((hdr.data_size + BLOCK_FILTER_SIZE - 1U) /
+                                   BLOCK_FILTER_SIZE);
+
+        if ((idx->size - sizeof(hdr)) / (BLOCK_FILTER_BITS / 8U) !=
+            idx->nr_blocks)
+            reason = "The index is truncated";
+    } else if (memcmp(hdr.magic, index_magic, sizeof(hdr.magic)) != 0 ||
+               (hdr.gram_bits != 16U && hdr.gram_bits != 24U)) {
+        reason = "Not an index";
+        goto unmap;
+    } else {
+        idx->gram_bits = (unsigned int) hdr.gram_bits;
+        table_size = (((size_t) 1U << idx->gram_bits) + 1U) *
+                     sizeof(uint64_t);
+        idx->offsets = (const uint64_t *) ((unsigned char *) idx->addr +
+                                           sizeof(hdr));
+        idx->postings = (const unsigned char *) idx->offsets + table_size;
+
+        if (idx->size < sizeof(hdr) + table_size) {
+            reason = "The index is truncated";
+            goto unmap;
+        }
+
+        idx->postings_size = idx->size - sizeof(hdr) - table_size;
+
+        /* The lists must follow each other within the index. */
+        for (gram = 0U; gram < (size_t) 1U << idx->gram_bits; gram++) {
+            if (idx->offsets[gram] > idx->offsets[gram + 1U])
+                break;
+        }
+
+        if (gram < (size_t) 1U << idx->gram_bits ||
+            idx->offsets[gram] != idx->postings_size)
+            reason = "The index is corrupted";
+    }
+
+    if (reason == NULL &&
+        (fstat(fd, &data_st) != 0 ||
+         hdr.data_size != (uint64_t) data_st.st_size ||
+         hdr.data_mtime != (int64_t) data_st.st_mtim.tv_sec ||
+         hdr.data_mtime_nsec != (int64_t) data_st.st_mtim.tv_nsec))
+        reason = "The file has changed since it was indexed";
+
+    if (reason == NULL)
+        return BM_OK;
+
+unmap:
+    munmap(idx->addr, idx->size);
+
+invalid:
+    fprintf(stderr,
+            "Failed to use the index %s: %s\n",
+            index_path,
+            reason);
+    return BM_INVALID_ARGS;
+}
+
+/* Returns bit @bit of the pattern given by hex digits of @hex_seq,
+   which are known to be valid. */
+static unsigned int hex_seq_bit(const char *hex_seq, size_t bit)
+{
+    unsigned int digit = (unsigned char) hex_seq[bit / 4U];
+
+    if (digit <= '9')
+        digit -= '0';
+    else
+        digit = (digit | 0x20U) - 'a' + 10U;
+
+    return digit >> (3U - bit % 4U) & 1U;
+}
+
+/* A gram of the pattern found at the byte boundary in the data. */
+struct pattern_gram {
+    size_t gram;
+    /* Distance in bytes from the first gram of the pattern
+       at the same boundary. */
+    size_t distance;
+    /* Posting list of the gram. */
+    const unsigned char *list;
+    const unsigned char *list_end;
+};
+
+static int compare_grams(const void *a, const void *b)
+{
+    const struct pattern_gram *ga = a, *gb = b;
+    size_t size_a = (size_t) (ga->list_end - ga->list);
+    size_t size_b = (size_t) (gb->list_end - gb->list);
+
+    return size_a < size_b ? -1 : size_a > size_b;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    size_t offset_a = *(const size_t *) a, offset_b = *(const size_t *) b;
+
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+/* Looks up the pattern of @nr_bits bits given by @hex_seq in the index.
+   Each match starts (8 - @shift) % 8 bits before a byte boundary for some
+   @shift of 0 - 7, so its bits @shift + 8 * J for each J are aligned
+   and their grams are in the index. For each @shift, the offsets where
+   all of the grams occur at the right distances from each other are
+   the candidates, which are found by intersecting the posting lists
+   starting from the shortest one. The candidates of @nr_data_bytes bytes
+   of the data are put to @pcandidates in increasing order.
+   Returns BM_OK if the index doesn't pay off, since some of the lists
+   to intersect are so long that it is cheaper to scan the data. */
+static int lookup_index(const struct bit_index *idx,
+                        const char *hex_seq,
+                        size_t nr_bits,
+                        size_t nr_data_bytes,
+                        size_t **pcandidates,
+                        size_t *pnr_candidates)
+{
+    const unsigned int gram_bits = idx->gram_bits;
+    const size_t max_grams = (nr_bits - gram_bits) / 8U + 1U;
+    struct pattern_gram *grams;
+    size_t *candidates = NULL, *bytes = NULL;
+    size_t nr_candidates = 0U, capacity = 0U, bytes_capacity = 0U;
+    unsigned int shift;
+    int ret_val = BM_FOUND;
+
+    grams = xmalloc(max_grams * sizeof(*grams));
+
+    for (shift = 0U; shift < 8U && ret_val == BM_FOUND; shift++) {
+        const unsigned char *in;
+        size_t nr_grams = (nr_bits - shift - gram_bits) / 8U + 1U;
+        size_t nr_bytes = 0U, i, j;
+        uint64_t pos = 0U, delta;
+
+        for (i = 0U; i < nr_grams; i++) {
+            size_t gram = 0U, bit;
+
+            for (bit = 0U; bit < gram_bits; bit++)
+                gram = gram << 1U |
+                       hex_seq_bit(hex_seq, shift + i * 8U + bit);
+
+            grams[i].gram = gram;
+            grams[i].distance = i;
+            grams[i].list = idx->postings + idx->offsets[gram];
+            grams[i].list_end = idx->postings + idx->offsets[gram + 1U];
+        }
+
+        qsort(grams, nr_grams, sizeof(*grams), compare_grams);
+
+        /* The shortest list gives the first gram of each candidate. */
+        for (in = grams[0].list; in < grams[0].list_end; ) {
+            size_t byte;
+
+            if ((in = get_varint(in, grams[0].list_end, &delta)) == NULL)
+                break;
+
+            pos += delta;
+            if (pos < grams[0].distance)
+                continue;
+
+            /* The match must start within the data and end there. */
+            byte = (size_t) pos - grams[0].distance;
+            if ((byte == 0U && shift != 0U) ||
+                byte * 8U - shift + nr_bits > nr_data_bytes * 8U)
+                continue;
+
+            if (nr_bytes == bytes_capacity) {
+                bytes_capacity = bytes_capacity != 0U ?
+                                 bytes_capacity * 2U : 16U;
+                bytes = xrealloc(bytes, bytes_capacity * sizeof(*bytes));
+            }
+
+            bytes[nr_bytes++] = byte;
+
+            if (nr_bytes > nr_data_bytes / INDEX_MAX_DENSITY) {
+                ret_val = BM_OK;
+                break;
+            }
+        }
+
+        /* The longer lists only weed the candidates out
+           unless verifying them is cheaper than reading the list. */
+        for (i = 1U; i < nr_grams && ret_val == BM_FOUND; i++) {
+            size_t nr_left = 0U;
+
+            if (nr_bytes == 0U ||
+                (size_t) (grams[i].list_end - grams[i].list) >
+                nr_bytes * INDEX_MAX_LIST_RATIO)
+                break;
+
+            pos = 0U;
+            j = 0U;
+
+            for (in = grams[i].list;
+                 in < grams[i].list_end && j < nr_bytes; ) {
+                if ((in = get_varint(in, grams[i].list_end, &delta)) == NULL)
+                    break;
+
+                pos += delta;
+                if (pos < grams[i].distance)
+                    continue;
+
+                while (j < nr_bytes &&
+                       bytes[j] < (size_t) pos - grams[i].distance)
+                    j++;
+
+                if (j < nr_bytes &&
+                    bytes[j] == (size_t) pos - grams[i].distance)
+                    bytes[nr_left++] = bytes[j++];
+            }
+
+            nr_bytes = nr_left;
+        }
+
+        for (j = 0U; j < nr_bytes && ret_val == BM_FOUND; j++) {
+            if (nr_candidates == capacity) {
+                capacity = capacity != 0U ? capacity * 2U : 16U;
+                candidates = xrealloc(candidates,
+                                      capacity * sizeof(*candidates));
+            }
+
+            candidates[nr_candidates++] = bytes[j] * 8U - shift;
+        }
+    }
+
+    xfree(bytes);
+    xfree(grams);
+
+    if (ret_val != BM_FOUND) {
+        xfree(candidates);
+        return ret_val;
+    }
+
+    if (nr_candidates > 1U)
+        qsort(candidates, nr_candidates, sizeof(*candidates),
+              compare_offsets);
+
+    *pcandidates = candidates;
+    *pnr_candidates = nr_candidates;
+    return BM_FOUND;
+}
+
+/* Tells whether the filter of @block may contain the gram
+   whose bits are @bits. */
+static int block_may_contain(const struct bit_index *idx,
+                             size_t block,
+                             const size_t bits[2])
+{
+    const unsigned char *filter = idx->filters +
+                                  block * (BLOCK_FILTER_BITS / 8U);
+
+    return (filter[bits[0] / 8U] >> bits[0] % 8U & 1U) &&
+           (filter[bits[1] / 8U] >> bits[1] % 8U & 1U);
+}
+
+/* Scans the blocks of @bufsz bytes of @buf which may hold the pattern
+   according to the block filter. The match starting in a block has its
+   first gram starting there, and each of its other grams starting there
+   or in the next block. BLOCK_FILTER_GRAMS grams spread evenly over
+   the pattern are tested. The adjacent blocks to scan are scanned
+   at once, together with the bits a match starting in the last
+   of them may extend to. */
+static int scan_blocks(const struct bit_index *idx,
+                       const struct bm_pattern *pat,
+                       const char *hex_seq,
+                       const unsigned char *buf,
+                       size_t bufsz,
+                       struct bm_sink *sink)
+{
+    size_t bits[BLOCK_FILTER_GRAMS][2];
+    const size_t nr_bits = bm_max_bits(pat);
+    const size_t block_bits = (size_t) BLOCK_FILTER_SIZE * 8U;
+    size_t nr_grams = 0U, block, first, i;
+    int ret_val = BM_NOT_FOUND;
+
+    for (i = 0U; i < BLOCK_FILTER_GRAMS; i++) {
+        /* Division last, so the offsets can't exceed the pattern. */
+        size_t offset = (nr_bits - 16U) / (BLOCK_FILTER_GRAMS - 1U) * i,
+               gram = 0U, bit;
+
+        /* Such grams may start past the next block. */
+        if (offset >= block_bits)
+            break;
+
+        for (bit = 0U; bit < 16U; bit++)
+            gram = gram << 1U | hex_seq_bit(hex_seq, offset + bit);
+
+        filter_bits_of(gram, bits[nr_grams++]);
+    }
+
+    for (block = 0U; block < idx->nr_blocks && !sink->stopped; ) {
+        size_t end;
+
+        /* Look for the run of the blocks which may hold the match. */
+        for (first = block; block < idx->nr_blocks; block++) {
+            for (i = 0U; i < nr_grams; i++) {
+                if (!block_may_contain(idx, block, bits[i]) &&
+                    (i == 0U || block + 1U == idx->nr_blocks ||
+                     !block_may_contain(idx, block + 1U, bits[i])))
+                    break;
+            }
+
+            if (i < nr_grams)
+                break;
+        }
+
+        if (block == first) {
+            block++;
+            continue;
+        }
+
+        end = block < idx->nr_blocks &&
+              bufsz * 8U - block * block_bits > nr_bits - 1U ?
+              block * block_bits + nr_bits - 1U :
+              bufsz * 8U;
+
+        if (end - first * block_bits >= nr_bits &&
+            bm_scan(pat, buf, first * block_bits, end, sink) == BM_FOUND)
+            ret_val = BM_FOUND;
+    }
+
+    return ret_val;
+}
+
+/* Scans the file @fd with the help of its index at @index_path.
+   The candidates found in the gram index are verified by scanning just
+   the bits of the data where they would be. The patterns too short to
+   hold a gram at each byte boundary, and the ones whose grams are common
+   in the data, are looked for by scanning the whole data.
+   With the block filter, only the blocks which may hold the pattern
+   are scanned. */
+static int scan_indexed(const struct bm_pattern *pat,
+                        const char *hex_seq,
+                        int fd,
+                        const char *index_path,
+                        struct bm_sink *sink,
+                        struct run_stats *rs)
+{
+    struct bit_index idx;
+    unsigned char *buf;
+    size_t bufsz, *candidates = NULL, nr_candidates = 0U, i;
+    const size_t nr_bits = bm_max_bits(pat);
+    int ret_val, mapped;
+    double since[2];
+
+    begin_phase(rs, since);
+
+    if ((ret_val = open_index(index_path, fd, &idx)) != BM_OK)
+        return ret_val;
+
+    ret_val = load_input(fd, &buf, &bufsz, &mapped, rs);
+    end_phase(rs, PHASE_INPUT, since);
+
+    if (ret_val != BM_OK) {
+        munmap(idx.addr, idx.size);
+        return ret_val;
+    }
+
+    begin_phase(rs, since);
+
+    if (bufsz > SIZE_MAX / 8U) {
+        fprintf(stderr,
+                "I/O error: "
+                "Input buffer is too large\n");
+        ret_val = BM_IO_ERR;
+    } else if (bufsz * 8U < nr_bits) {
+        ret_val = BM_NOT_FOUND;
+    } else if (idx.filters != NULL && nr_bits >= idx.gram_bits) {
+        ret_val = scan_blocks(&idx, pat, hex_seq, buf, bufsz, sink);
+    } else if (idx.filters != NULL || nr_bits < idx.gram_bits + 7U ||
+               lookup_index(&idx, hex_seq, nr_bits, bufsz,
+                            &candidates, &nr_candidates) != BM_FOUND) {
+        ret_val = bm_scan(pat, buf, 0U, bufsz * 8U, sink);
+    } else {
+        ret_val = BM_NOT_FOUND;
+
+        for (i = 0U; i < nr_candidates && !sink->stopped; i++) {
+            if (bm_scan(pat, buf, candidates[i], candidates[i] + nr_bits,
+                        sink) == BM_FOUND)
+                ret_val = BM_FOUND;
+        }
+
+        xfree(candidates);
+    }
+
+    end_phase(rs, PHASE_SCAN, since);
+
+    release_input(buf, bufsz, mapped);
+    munmap(idx.addr, idx.size);
+    return ret_val;
+}
+
+/* Parses the number of bits an approximate match may differ in. */
+static int get_max_errors(const char *max_errors_s, size_t *max_errors)
+{
+    unsigned long val;
+    char *left = NULL;
+
+    errno = 0;
+    val = strtoul(max_errors_s, &left, 10);
+    if (errno != 0) {
+        perror("Failed to parse the number of errors");
+        return BM_INVALID_ARGS;
+    } else if (left == max_errors_s) {
+        fprintf(stderr,
+                "Failed to parse the number of errors: "
+                "No digits found\n");
+        return BM_INVALID_ARGS;
+    } else if (*left != '\0') {
+        fprintf(stderr,
+                "Failed to parse the number of errors: "
+                "Extra characters at the end of the argument\n");
+        return BM_INVALID_ARGS;
+    }
+
+    *max_errors = (size_t) val;
+    return BM_OK;
+}
+
+/* Parses the number of threads of the parallel scan. */
+static int get_nr_threads(const char *nr_threads_s, unsigned int *nr_threads)
+{
+    unsigned long val;
+    char *left = NULL;
+
+    errno = 0;
+    val = strtoul(nr_threads_s, &left, 10);
+    if (errno != 0) {
+        perror("Failed to parse the number of threads");
+        return BM_INVALID_ARGS;
+    } else if (left == nr_threads_s) {
+        fprintf(stderr,
+                "Failed to parse the number of threads: "
+                "No digits found\n");
+        return BM_INVALID_ARGS;
+    } else if (*left != '\0') {
+        fprintf(stderr,
+                "Failed to parse the number of threads: "
+                "Extra characters at the end of the argument\n");
+        return BM_INVALID_ARGS;
+    } else if (val == 0U || val > MAX_THREADS) {
+        fprintf(stderr,
+                "Failed to parse the number of threads: "
+                "The number must be in range 1 - %u\n",
+                MAX_THREADS);
+        return BM_INVALID_ARGS;
+    }
+
+    *nr_threads = (unsigned int) val;
+    return BM_OK;
+}
+
+/* Prints the statistics of the run to stderr. */
+static void print_stats(const struct run_stats *rs)
+{
+    static const char *const phase_names[NR_PHASES] = {
+        "compile", "input", "scan",
+    };
+    unsigned int i;
+
+    fprintf(stderr,
+            "bytes read:      %zu in %zu read calls\n"
+            "bytes mapped:    %zu\n"
+            "reallocations:   %zu\n",
+            rs->nr_bytes_read,
+            rs->nr_reads,
+            rs->nr_bytes_mapped,
+            rs->nr_reallocs);
+
+    for (i = 0U; i < NR_PHASES; i++)
+        fprintf(stderr,
+                "%-8s time:    wall %.6f s, cpu %.6f s\n",
+                phase_names[i],
+                rs->wall[i],
+                rs->cpu[i]);
+
+    /* Candidates are the positions passed by the filter of the engine,
+       such as hash hits, which needed verification. */
+    fprintf(stderr,
+            "candidates:      %zu\n"
+            "confirmed:       %zu\n"
+            "false positives: %zu (%.2f%%)\n",
+            rs->engine.nr_verified,
+            rs->engine.nr_verified - rs->engine.nr_rejected,
+            rs->engine.nr_rejected,
+            rs->engine.nr_verified != 0U ?
+            100.0 * (double) rs->engine.nr_rejected /
+            (double) rs->engine.nr_verified : 0.0);
+}
+
+/* Value returned by getopt_long() for the option without short form. */
+#define OPT_STATS 256
+
+static const struct option long_options[] = {
+    { "stream",          no_argument,       NULL, 's' },
+    { "threads",         required_argument, NULL, 'j' },
+    { "all",             no_argument,       NULL, 'a' },
+    { "non-overlapping", no_argument,       NULL, 'n' },
+    { "count",           no_argument,       NULL, 'c' },
+    { "patterns",        required_argument, NULL, 'f' },
+    { "mask",            required_argument, NULL, 'm' },
+    { "max-errors",      required_argument, NULL, 'k' },
+    { "recursive",       no_argument,       NULL, 'r' },
+    { "files-with-matches", no_argument,    NULL, 'l' },
+    { "index",           required_argument, NULL, 'i' },
+    { "stats",           no_argument,       NULL, OPT_STATS },
+    { NULL,              0,                 NULL, 0   },
+};
+
+/* Builds the index of the file given by the arguments
+   of the index command. */
+static int index_main(int argc, char *argv[])
+{
+    struct run_stats rs;
+    struct stat st;
+    unsigned int gram_bits = INDEX_GRAM_BITS;
+    unsigned char *buf;
+    char *index_path;
+    const char *suffix = INDEX_SUFFIX;
+    size_t len, bufsz;
+    int opt, fd, ret_val, mapped, block_filter = 0;
+
+    while ((opt = getopt(argc, argv, "q:b")) != -1) {
+        switch (opt) {
+        case 'q':
+            if (strcmp(optarg, "16") == 0) {
+                gram_bits = 16U;
+            } else if (strcmp(optarg, "24") == 0) {
+                gram_bits = 24U;
+            } else {
+                fprintf(stderr,
+                        "Failed to parse the number of gram bits: "
+                        "The number must be 16 or 24\n");
+                return BM_INVALID_ARGS;
+            }
+            break;
+        case 'b':
+            block_filter = 1;
+            suffix = BLOCK_FILTER_SUFFIX;
+            break;
+        default:
+            print_usage();
+            return BM_USAGE_ERR;
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2) {
+        print_usage();
+        return BM_USAGE_ERR;
+    }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                argv[optind],
+                strerror(errno));
+        return BM_IO_ERR;
+    }
+
+    /* The index refers to the size and the modification time
+       of the file, which pipes don't have. */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr,
+                "Failed to build the index: "
+                "Only regular files can be indexed\n");
+        close(fd);
+        return BM_INVALID_ARGS;
+    }
+
+    memset(&rs, 0, sizeof(rs));
+    if ((ret_val = load_input(fd, &buf, &bufsz, &mapped, &rs)) != BM_OK) {
+        close(fd);
+        return ret_val;
+    }
+
+    /* The index of the file lies next to it by default. */
+    if (argc - optind > 1) {
+        len = strlen(argv[optind + 1]) + 1U;
+        index_path = xmalloc(len);
+        memcpy(index_path, argv[optind + 1], len);
+    } else {
+        len = strlen(argv[optind]);
+        index_path = xmalloc(len + strlen(suffix) + 1U);
+        memcpy(index_path, argv[optind], len);
+        memcpy(index_path + len, suffix, strlen(suffix) + 1U);
+    }
+
+    if (block_filter)
+        ret_val = build_block_filter(buf, bufsz, &st, index_path);
+    else
+        ret_val = build_index(buf, bufsz, &st, index_path, gram_bits);
+
+    xfree(index_path);
+    release_input(buf, bufsz, mapped);
+    close(fd);
+    return ret_val == BM_OK ? EXIT_SUCCESS : ret_val;
+}
+
+int BITMATCH_MAIN(int argc, char *argv[])
+{
+    static char *const default_paths[] = { "." };
+    struct bm_pattern *pat = NULL;
+    struct match_printer printer;
+    struct bm_sink first_match, *sink = &first_match;
+    struct run_stats stats;
+    struct stat st;
+    size_t max_errors = 0U, *member_lines = NULL;
+    char *mask_seq = NULL, *const *paths;
+    const char *set_path = NULL, *path = NULL, *index_path = NULL;
+    int ret_val, opt, streaming = 0, fd = STDIN_FILENO, nr_pat_args;
+    int recursive = 0, list_files = 0, many_files;
+    unsigned int nr_threads = 1U;
+    size_t nr_paths;
+    double since[2];
+
+    memset(&first_match, 0, sizeof(first_match));
+    first_match.report = stop_at_first;
+    memset(&printer, 0, sizeof(printer));
+    printer.sink.report = print_match;
+    printer.out = stdout;
+    memset(&stats, 0, sizeof(stats));
+
+    if (argc > 1 && strcmp(argv[1], "index") == 0)
+        return index_main(argc - 1, argv + 1);
+
+    while ((opt = getopt_long(argc, argv, "sj:ancf:m:k:rli:",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            streaming = 1;
+            break;
+        case 'j':
+            if ((ret_val = get_nr_threads(optarg, &nr_threads)) != BM_OK)
+                return ret_val;
+            break;
+        case 'a':
+            sink = &printer.sink;
+            break;
+        case 'n':
+            sink = &printer.sink;
+            printer.non_overlapping = 1;
+            break;
+        case 'c':
+            sink = &printer.sink;
+            printer.count_only = 1;
+            break;
+        case 'f':
+            set_path = optarg;
+            break;
+        case 'm':
+            mask_seq = optarg;
+            break;
+        case 'k':
+            if ((ret_val = get_max_errors(optarg, &max_errors)) != BM_OK)
+                return ret_val;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 'l':
+            list_files = 1;
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case OPT_STATS:
+            stats.enabled = 1;
+            first_match.stats = &stats.engine;
+            printer.sink.stats = &stats.engine;
+            break;
+        default:
+            print_usage();
+            return BM_USAGE_ERR;
+        }
+    }
+
+    /* The pattern set replaces the pattern arguments. */
+    nr_pat_args = set_path == NULL ? 2 : 0;
+
+    if (argc - optind < nr_pat_args) {
+        print_usage();
+        return BM_USAGE_ERR;
+    }
+
+    paths = argv + optind + nr_pat_args;
+    nr_paths = (size_t) (argc - optind - nr_pat_args);
+    /* The recursive scan starts from the current directory by default. */
+    if (recursive && nr_paths == 0U) {
+        paths = default_paths;
+        nr_paths = 1U;
+    }
+    /* Each of many files is scanned by a single thread. */
+    many_files = recursive || nr_paths > 1U;
+
+    /* Streaming mode scans the chunks of a single input in order
+       as they arrive. The names of the files are printed instead of
+       the matches. The mask and approximate matching apply to the pattern
+       given by the arguments only. */
+    if ((streaming && nr_threads > 1U && !many_files) ||
+        (list_files && sink != &first_match) ||
+        (set_path != NULL && (mask_seq != NULL || max_errors != 0U)) ||
+        (index_path != NULL &&
+         (many_files || nr_paths == 0U || set_path != NULL ||
+          mask_seq != NULL || max_errors != 0U || streaming ||
+          nr_threads > 1U))) {
+        print_usage();
+        return BM_USAGE_ERR;
+    }
+
+    if (nr_paths == 1U && !many_files)
+        path = paths[0];
+
+    begin_phase(&stats, since);
+
+    if (set_path != NULL)
+        ret_val = get_pattern_set(set_path, &pat, &member_lines);
+    else
+        ret_val = get_pattern(argv[optind], argv[optind + 1],
+                              mask_seq, max_errors, &pat);
+
+    end_phase(&stats, PHASE_COMPILE, since);
+
+    if (ret_val != BM_OK)
+        return ret_val;
+
+    printer.pat = pat;
+    printer.member_lines = member_lines;
+
+    if (many_files) {
+        ret_val = scan_files(pat, paths, nr_paths, recursive, nr_threads,
+                             streaming,
+                             sink == &first_match ? NULL : &printer,
+                             &stats);
+        goto out;
+    }
+
+    if (printer.count_only && !printer.non_overlapping)
+        printer.sink.nr_counted = &printer.nr_matches;
+
+    if (path != NULL && (fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                path,
+                strerror(errno));
+        bm_free(pat);
+        xfree(member_lines);
+        return BM_IO_ERR;
+    }
+
+    /* The input which can't be mapped, such as a pipe, is scanned
+       as it arrives. The scan stops at the first match without waiting
+       for the rest of the input, which may never end. */
+    if (index_path != NULL)
+        ret_val = scan_indexed(pat, argv[optind], fd, index_path,
+                               sink, &stats);
+    else if (streaming ||
+             (nr_threads == 1U &&
+              (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))))
+        ret_val = scan_pipelined(pat, fd, sink, &stats);
+    else
+        ret_val = scan_input(pat, fd, nr_threads, sink,
+                             sink == &first_match, &stats);
+
+    if (printer.count_only &&
+        (ret_val == BM_FOUND || ret_val == BM_NOT_FOUND))
+        printf("%zu\n", printer.nr_matches);
+    else if (list_files && ret_val == BM_FOUND)
+        printf("%s\n", path != NULL ? path : "(standard input)");
+
+out:
+    if (stats.enabled)
+        print_stats(&stats);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+    bm_free(pat);
+    xfree(member_lines);
+
+    if (fflush(stdout) != 0) {
+        perror("I/O error");
+        return BM_IO_ERR;
+    }
 
     return ret_val;
 }
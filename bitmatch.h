@@ -0,0 +1,143 @@
+#ifndef BITMATCH_H
+#define BITMATCH_H
+
+#include <stddef.h>
+
+/* Status codes returned by the library functions.
+   The command line tool exits with them as well. */
+enum bitmatch_exit_codes {
+    BM_FOUND        = 0,
+    BM_NOT_FOUND    = 1,
+    BM_OK           = 2,
+    BM_USAGE_ERR    = 3,
+    BM_INVALID_ARGS = 4,
+    BM_NO_MEM       = 5,
+    BM_IO_ERR       = 6,
+};
+
+/* Compiled pattern or set of patterns.
+   It is never modified by the scans, so any number of threads
+   may scan with the same pattern at once. */
+struct bm_pattern;
+
+/* State of the scan of the data arriving in chunks. */
+struct bm_stream;
+
+/* Counters of the work done by the scans. */
+struct bm_stats {
+    /* Positions passed by the filter of the engine to verification. */
+    size_t nr_verified;
+    /* Verified positions which turned out not to match. */
+    size_t nr_rejected;
+};
+
+/* Receives matches found by the scans in increasing order of their offsets.
+   The matches of a set are received in increasing order of their end
+   offsets. The offsets are relative to the scanned buffer.
+   The structure is usually embedded into a larger one describing
+   what to do with the matches. */
+struct bm_sink {
+    /* Returns non-zero if the scan should stop.
+       @member is the index of the matched pattern in the set, or 0. */
+    int (*report)(struct bm_sink *sink, size_t pos, size_t member);
+    /* Bit offset of the scanned buffer within the whole input. */
+    size_t base;
+    /* The matches ending at or before this bit of the buffer are not
+       reported. The scan of the range overlapping the preceding one
+       sets it to the end of the overlap, so the shorter patterns of
+       a set found by both scans are reported once. It must not exceed
+       the start of the range plus bm_max_bits() - 1. 0 reports all. */
+    size_t skip_until;
+    /* Set once report() asks to stop the scan. */
+    int stopped;
+    /* If the sink accepts overlapping matches and needs just their number,
+       engines with dedicated counting routine add it here instead of
+       reporting the matches. NULL otherwise. */
+    size_t *nr_counted;
+    /* Receives the counters of the work done by the engines, or NULL. */
+    struct bm_stats *stats;
+};
+
+/* Compiles the pattern of @nr_bits bits given by hex digits of @hex_seq.
+   @mask_seq is the hex encoded mask of the bits which must match, or NULL
+   if all of them must. The matches may differ from the pattern
+   in @max_errors bits. On failure, the reason is put to @err
+   of @err_size bytes unless it is NULL. */
+int bm_compile(const char *hex_seq,
+               size_t nr_bits,
+               const char *mask_seq,
+               size_t max_errors,
+               struct bm_pattern **ppat,
+               char *err,
+               size_t err_size);
+
+/* Compiles the set of @nr_patterns patterns looked for at once.
+   Pattern I has @nr_bits[I] bits given by hex digits of @hex_seqs[I].
+   Its matches are reported with member index I. */
+int bm_compile_set(const char *const *hex_seqs,
+                   const size_t *nr_bits,
+                   size_t nr_patterns,
+                   struct bm_pattern **ppat,
+                   char *err,
+                   size_t err_size);
+
+/* Releases the compiled pattern. */
+void bm_free(struct bm_pattern *pat);
+
+/* Returns the length of the shortest and the longest pattern of the set.
+   Both are the pattern length for a single pattern. */
+size_t bm_min_bits(const struct bm_pattern *pat);
+size_t bm_max_bits(const struct bm_pattern *pat);
+
+/* Returns the length of the pattern @member of the set.
+   For a single pattern, @member is 0. */
+size_t bm_member_bits(const struct bm_pattern *pat, size_t member);
+
+/* Locate occurrences of the pattern in bit range [@offset, @end) of @buf.
+   Each of them lying entirely within the range is reported to @sink
+   until it asks to stop, unless it ends at or before sink->skip_until.
+   Returns BM_FOUND if there was at least one.
+   The caller must guarantee @end - @offset >= bm_min_bits(). Adjacent ranges
+   must overlap by bm_max_bits() - 1 bits to find the matches across
+   their boundary. The matches of the shorter patterns of a set ending
+   within the overlap are found by both scans, so the scan of the later
+   range sets sink->skip_until to @offset + bm_max_bits() - 1 to have
+   each of them reported once. */
+int bm_scan(const struct bm_pattern *pat,
+            const unsigned char *buf,
+            size_t offset,
+            size_t end,
+            struct bm_sink *sink);
+
+/* Starts the scan of the data which is passed to bm_feed() in chunks.
+   The matches are reported to @sink with offsets relative to
+   the start of the data. The stream sets sink->base and sink->skip_until
+   itself. */
+int bm_stream_open(const struct bm_pattern *pat,
+                   struct bm_sink *sink,
+                   struct bm_stream **pstream);
+
+/* Scans @size bytes of @data following the data fed before.
+   The data fed since the last scan is scanned before it returns once it
+   holds at least as many bits as the longest pattern, otherwise it is
+   held back until more data is fed, so the matches it completes are
+   reported later. The matches of the shorter patterns of a set are found
+   once more data is fed or the stream is finished.
+   Returns BM_FOUND if there were any matches. Once @sink asks to stop,
+   the rest of the data is ignored. No memory is allocated. */
+int bm_feed(struct bm_stream *stream, const unsigned char *data, size_t size);
+
+/* Scans the data held back by bm_feed() right away, for instance
+   while waiting for more data to arrive. Each call scans the bits
+   carried over from the previous scan once more.
+   Returns BM_FOUND if there were any matches. */
+int bm_stream_flush(struct bm_stream *stream);
+
+/* Tells that there is no more data.
+   Returns BM_FOUND if there were any more matches. */
+int bm_stream_finish(struct bm_stream *stream);
+
+/* Releases the stream. */
+void bm_stream_free(struct bm_stream *stream);
+
+#endif
@@ -0,0 +1,979 @@
+/* Differential fuzzer of the engines of the library.
+   Each engine able to handle the pattern scans the data as a whole,
+   in overlapping slices of random length, and as a stream split into
+   chunks of random sizes. The parallel and the pipelined scans of
+   the program itself are run too, with a random number of threads and
+   a writer feeding the pipe in chunks of random sizes. The matches are
+   compared with the ones found by checking each bit offset one by one.
+   Any difference is printed and the program is aborted.
+
+   Without arguments, random cases are generated from consecutive seeds.
+   Given a file, the single case decoded from its contents is checked,
+   which suits AFL. Built with -DFUZZ_LIBFUZZER -fsanitize=fuzzer,
+   the same decoding is used by libFuzzer entry point instead of main(). */
+
+/* Small limits make the rare paths of the engines reachable
+   with the inputs of a few kilobytes. */
+#define FILTER_BASE_FAILURES 16U
+#define FEED_CHUNK_SIZE 7U
+#define AUTOMATON_TABLE_MAX_STATES 40U
+#define THREAD_SLICE_SIZE 16U
+#define STREAM_CHUNK_SIZE 16U
+#define READ_AHEAD_CHUNKS 2U
+#define STREAM_FLUSH_DELAY 0U
+#define BITMATCH_MAIN bitmatch_main
+
+#include "libbitmatch.c"
+#include "use_engine.c"
+#include "bitmatch.c"
+
+#include <signal.h>
+
+/* Upper limit for the number of patterns of a set. */
+#define FUZZ_MAX_PATTERNS 4U
+/* Upper limits for the length of a pattern and the size of the data
+   of the generated cases. */
+#define FUZZ_MAX_BITS 1100U
+#define FUZZ_MAX_SIZE 20000U
+/* Default number of the generated cases. */
+#define FUZZ_NR_CASES 10000U
+/* Upper limit for the number of threads of the parallel scan. */
+#define FUZZ_MAX_THREADS 4U
+
+struct fuzz_case {
+    /* The patterns of the set, or the single pattern. */
+    size_t nr_patterns;
+    unsigned char *patterns[FUZZ_MAX_PATTERNS];
+    size_t nr_bits[FUZZ_MAX_PATTERNS];
+    /* The mask and the number of errors of the single pattern. */
+    unsigned char *mask;
+    size_t max_errors;
+    const unsigned char *data;
+    size_t size;
+    /* Seeds the sizes of slices and chunks. */
+    uint64_t seed;
+};
+
+/* Pseudo-random numbers (xorshift64). */
+static uint64_t fuzz_random(uint64_t *state)
+{
+    *state ^= *state << 13U;
+    *state ^= *state >> 7U;
+    *state ^= *state << 17U;
+
+    return *state;
+}
+
+/* Returns the random number in range [0, @limit). */
+static size_t fuzz_below(uint64_t *state, size_t limit)
+{
+    return (size_t) (fuzz_random(state) % limit);
+}
+
+static void *fuzz_alloc(size_t size)
+{
+    void *ptr;
+
+    if ((ptr = calloc(1U, size != 0U ? size : 1U)) == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes of memory\n", size);
+        exit(BM_NO_MEM);
+    }
+
+    return ptr;
+}
+
+/* The match of the pattern @member at bit offset @pos. */
+struct fuzz_match {
+    size_t pos;
+    size_t member;
+};
+
+/* Collects the matches reported by the engines. */
+struct fuzz_sink {
+    struct bm_sink sink;
+    struct fuzz_match *matches;
+    size_t nr_matches;
+    size_t capacity;
+    /* Stop the scan once this many matches are collected, unless 0. */
+    size_t limit;
+};
+
+static int fuzz_collect(struct bm_sink *sink, size_t pos, size_t member)
+{
+    struct fuzz_sink *fs = (struct fuzz_sink *) sink;
+
+    if (fs->nr_matches == fs->capacity) {
+        fs->capacity = fs->capacity != 0U ? fs->capacity * 2U : 64U;
+        fs->matches = realloc(fs->matches,
+                              fs->capacity * sizeof(*fs->matches));
+        if (fs->matches == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(BM_NO_MEM);
+        }
+    }
+
+    fs->matches[fs->nr_matches].pos = pos + sink->base;
+    fs->matches[fs->nr_matches].member = member;
+    fs->nr_matches++;
+
+    return fs->nr_matches == fs->limit;
+}
+
+static void init_sink(struct fuzz_sink *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->sink.report = fuzz_collect;
+}
+
+static int compare_matches(const void *a, const void *b)
+{
+    const struct fuzz_match *m1 = a, *m2 = b;
+
+    if (m1->pos != m2->pos)
+        return m1->pos < m2->pos ? -1 : 1;
+    if (m1->member != m2->member)
+        return m1->member < m2->member ? -1 : 1;
+
+    return 0;
+}
+
+/* Finds the matches by checking each bit offset one by one. */
+static void find_naive(const struct fuzz_case *fc, struct fuzz_sink *fs)
+{
+    size_t member, pos, i;
+
+    init_sink(fs);
+
+    for (pos = 0U; pos < fc->size * 8U; pos++) {
+        for (member = 0U; member < fc->nr_patterns; member++) {
+            size_t nr_errors = 0U;
+
+            if (fc->size * 8U - pos < fc->nr_bits[member])
+                continue;
+
+            for (i = 0U; i < fc->nr_bits[member]; i++) {
+                if (fc->mask != NULL &&
+                    extract_bitfield(fc->mask, i, 1) == 0U)
+                    continue;
+
+                nr_errors += extract_bitfield(fc->data, pos + i, 1) ^
+                             extract_bitfield(fc->patterns[member], i, 1);
+                if (nr_errors > fc->max_errors)
+                    break;
+            }
+
+            if (nr_errors <= fc->max_errors)
+                fuzz_collect(&fs->sink, pos, member);
+        }
+    }
+}
+
+static char *to_hex(const unsigned char *buf, size_t nr_bits)
+{
+    char *hex_seq = fuzz_alloc((nr_bits + 7U) / 8U * 2U + 1U);
+    size_t i;
+
+    for (i = 0U; i < (nr_bits + 7U) / 8U; i++)
+        sprintf(hex_seq + 2U * i, "%02x", buf[i]);
+
+    return hex_seq;
+}
+
+static void print_case(const struct fuzz_case *fc)
+{
+    char *hex_seq;
+    size_t i;
+
+    for (i = 0U; i < fc->nr_patterns; i++) {
+        hex_seq = to_hex(fc->patterns[i], fc->nr_bits[i]);
+        fprintf(stderr, "pattern %s %zu\n", hex_seq, fc->nr_bits[i]);
+        free(hex_seq);
+    }
+
+    if (fc->mask != NULL) {
+        hex_seq = to_hex(fc->mask, fc->nr_bits[0]);
+        fprintf(stderr, "mask %s\n", hex_seq);
+        free(hex_seq);
+    }
+
+    fprintf(stderr,
+            "errors %zu, data %zu bytes, seed %llu\n",
+            fc->max_errors,
+            fc->size,
+            (unsigned long long) fc->seed);
+}
+
+/* The matches are reported in order of their start offsets,
+   or their end offsets for a set. */
+static size_t match_key(const struct fuzz_case *fc,
+                        const struct fuzz_match *m)
+{
+    return fc->nr_patterns > 1U ? m->pos + fc->nr_bits[m->member] : m->pos;
+}
+
+/* Compares the matches found by @engine in @how way with the expected ones.
+   The matches must be reported in order of their start offsets,
+   or their end offsets for a set. */
+static void check_matches(const struct fuzz_case *fc,
+                          const char *engine,
+                          const char *how,
+                          struct fuzz_sink *fs,
+                          const struct fuzz_sink *expected)
+{
+    size_t i, prev = 0U;
+
+    for (i = 0U; i < fs->nr_matches; i++) {
+        size_t key = match_key(fc, &fs->matches[i]);
+
+        if (i > 0U && (key < prev || (key == prev && fc->nr_patterns == 1U))) {
+            fprintf(stderr,
+                    "%s engine (%s) reported the match at %zu out of order\n",
+                    engine,
+                    how,
+                    fs->matches[i].pos);
+            print_case(fc);
+            abort();
+        }
+
+        prev = key;
+    }
+
+    if (fs->nr_matches > 1U)
+        qsort(fs->matches,
+              fs->nr_matches,
+              sizeof(*fs->matches),
+              compare_matches);
+
+    for (i = 0U; i < fs->nr_matches || i < expected->nr_matches; i++) {
+        if (i < fs->nr_matches && i < expected->nr_matches &&
+            compare_matches(&fs->matches[i], &expected->matches[i]) == 0)
+            continue;
+
+        fprintf(stderr,
+                "%s engine (%s) found %zu matches instead of %zu, "
+                "the first difference is at ",
+                engine,
+                how,
+                fs->nr_matches,
+                expected->nr_matches);
+        if (i < expected->nr_matches)
+            fprintf(stderr,
+                    "the expected match %zu of pattern %zu\n",
+                    expected->matches[i].pos,
+                    expected->matches[i].member);
+        else
+            fprintf(stderr,
+                    "the extra match %zu of pattern %zu\n",
+                    fs->matches[i].pos,
+                    fs->matches[i].member);
+        print_case(fc);
+        abort();
+    }
+
+    free(fs->matches);
+}
+
+/* Checks the matches reported until the sink of @fs asked to stop:
+   they must be the expected ones which are reported first.
+   The matches of a set ending at the same offset may come in any order,
+   so the ones ending along with the last reported match are checked
+   just to be expected. */
+static void check_stopped(const struct fuzz_case *fc,
+                          const char *engine,
+                          const char *how,
+                          struct fuzz_sink *fs,
+                          const struct fuzz_sink *expected)
+{
+    struct fuzz_sink first;
+    size_t last, i, j;
+
+    if (fs->limit == 0U || expected->nr_matches <= fs->limit) {
+        check_matches(fc, engine, how, fs, expected);
+        return;
+    }
+
+    if (fs->nr_matches != fs->limit) {
+        fprintf(stderr,
+                "%s engine (%s) reported %zu matches before stopping "
+                "instead of %zu\n",
+                engine,
+                how,
+                fs->nr_matches,
+                fs->limit);
+        print_case(fc);
+        abort();
+    }
+
+    last = match_key(fc, &fs->matches[fs->nr_matches - 1U]);
+
+    init_sink(&first);
+    for (i = 0U; i < expected->nr_matches; i++) {
+        const struct fuzz_match *m = &expected->matches[i];
+
+        if (match_key(fc, m) < last) {
+            fuzz_collect(&first.sink, m->pos, m->member);
+            continue;
+        }
+
+        if (match_key(fc, m) > last)
+            continue;
+
+        for (j = 0U; j < fs->nr_matches; j++) {
+            if (compare_matches(&fs->matches[j], m) == 0) {
+                fuzz_collect(&first.sink, m->pos, m->member);
+                break;
+            }
+        }
+    }
+
+    check_matches(fc, engine, how, fs, &first);
+    free(first.matches);
+}
+
+/* Counts the matches accepted by -n: each one must start past the end
+   of the previous one, taking them in order of their end offsets. */
+static size_t count_non_overlapping(const struct fuzz_case *fc,
+                                    const struct fuzz_sink *expected)
+{
+    struct fuzz_match *ends;
+    size_t nr_accepted = 0U, next = 0U, i;
+
+    /* The end and the start offset of each match, sorted this way. */
+    ends = fuzz_alloc(expected->nr_matches * sizeof(*ends));
+    for (i = 0U; i < expected->nr_matches; i++) {
+        const struct fuzz_match *m = &expected->matches[i];
+
+        ends[i].pos = m->pos + fc->nr_bits[m->member];
+        ends[i].member = m->pos;
+    }
+
+    if (expected->nr_matches > 1U)
+        qsort(ends, expected->nr_matches, sizeof(*ends), compare_matches);
+
+    for (i = 0U; i < expected->nr_matches; i++) {
+        if (ends[i].member >= next) {
+            nr_accepted++;
+            next = ends[i].pos;
+        }
+    }
+
+    free(ends);
+    return nr_accepted;
+}
+
+/* Runs the parallel scan of the program with a random number of threads
+   to collect all the matches, to stop after a random number of them and
+   to count them as -c does, with -n or without. */
+static void check_parallel(const struct bm_pattern *pat,
+                           const struct fuzz_case *fc,
+                           const char *engine,
+                           uint64_t *state,
+                           const struct fuzz_sink *expected)
+{
+    struct match_printer printer;
+    struct fuzz_sink fs;
+    unsigned int nr_threads;
+    size_t nr_expected;
+    int first_only;
+
+    nr_threads = 1U + (unsigned int) fuzz_below(state, FUZZ_MAX_THREADS);
+
+    init_sink(&fs);
+    scan_parallel(pat, fc->data, fc->size * 8U, nr_threads, &fs.sink, 0);
+    check_matches(fc, engine, "parallel", &fs, expected);
+
+    init_sink(&fs);
+    fs.limit = 1U + fuzz_below(state, 4U);
+    /* The program stops at the first match this way. */
+    first_only = fs.limit == 1U && fuzz_below(state, 2U) != 0U;
+    scan_parallel(pat,
+                  fc->data,
+                  fc->size * 8U,
+                  nr_threads,
+                  &fs.sink,
+                  first_only);
+    check_stopped(fc, engine, "parallel, stopped", &fs, expected);
+
+    memset(&printer, 0, sizeof(printer));
+    printer.sink.report = print_match;
+    printer.pat = pat;
+    printer.count_only = 1;
+    printer.non_overlapping = fuzz_below(state, 2U) != 0U;
+    if (!printer.non_overlapping)
+        printer.sink.nr_counted = &printer.nr_matches;
+    scan_parallel(pat, fc->data, fc->size * 8U, nr_threads, &printer.sink, 0);
+
+    nr_expected = printer.non_overlapping ?
+                  count_non_overlapping(fc, expected) :
+                  expected->nr_matches;
+    if (printer.nr_matches != nr_expected) {
+        fprintf(stderr,
+                "%s engine (parallel) counted %zu %smatches instead of %zu\n",
+                engine,
+                printer.nr_matches,
+                printer.non_overlapping ? "non-overlapping " : "",
+                nr_expected);
+        print_case(fc);
+        abort();
+    }
+}
+
+/* Scans the data in slices of random length overlapping by
+   the length of the longest pattern less one bit. */
+static void scan_sliced(const struct bm_pattern *pat,
+                        const struct fuzz_case *fc,
+                        uint64_t *state,
+                        struct bm_sink *sink)
+{
+    size_t slice_bits = 1U + fuzz_below(state, 4096U);
+    size_t offset = 0U, end = fc->size * 8U, max_bits = bm_max_bits(pat);
+
+    while (1) {
+        size_t slice_end = end - offset > slice_bits + max_bits - 1U ?
+                           offset + slice_bits + max_bits - 1U :
+                           end;
+
+        sink->skip_until = offset != 0U ? offset + max_bits - 1U : 0U;
+        bm_scan(pat, fc->data, offset, slice_end, sink);
+
+        if (slice_end == end)
+            break;
+
+        offset += slice_bits;
+    }
+}
+
+/* Scans a random range of the data on its own and checks that
+   every expected match within the range is reported. */
+static void check_range(const struct bm_pattern *pat,
+                        const struct fuzz_case *fc,
+                        const char *engine,
+                        uint64_t *state,
+                        const struct fuzz_sink *expected)
+{
+    struct fuzz_sink fs, within;
+    size_t min_bits = bm_min_bits(pat), offset, end, i;
+
+    offset = fuzz_below(state, fc->size * 8U - min_bits + 1U);
+    end = offset + min_bits +
+          fuzz_below(state, fc->size * 8U - offset - min_bits + 1U);
+
+    init_sink(&within);
+    for (i = 0U; i < expected->nr_matches; i++) {
+        const struct fuzz_match *m = &expected->matches[i];
+
+        if (m->pos >= offset && m->pos + fc->nr_bits[m->member] <= end)
+            fuzz_collect(&within.sink, m->pos, m->member);
+    }
+
+    init_sink(&fs);
+    bm_scan(pat, fc->data, offset, end, &fs.sink);
+    check_matches(fc, engine, "range", &fs, &within);
+
+    free(within.matches);
+}
+
+/* Feeds the data to the stream in chunks of random sizes,
+   empty ones included, flushing it now and then. */
+static void scan_chunked(const struct bm_pattern *pat,
+                         const struct fuzz_case *fc,
+                         uint64_t *state,
+                         struct bm_sink *sink)
+{
+    struct bm_stream *stream;
+    size_t max_chunk = 1U + fuzz_below(state, fuzz_below(state, 2U) != 0U ?
+                                              3U * FEED_CHUNK_SIZE :
+                                              fc->size + 1U);
+    size_t done = 0U;
+
+    if (bm_stream_open(pat, sink, &stream) != BM_OK) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(BM_NO_MEM);
+    }
+
+    while (done < fc->size) {
+        size_t count = fuzz_below(state, max_chunk + 1U);
+
+        if (count > fc->size - done)
+            count = fc->size - done;
+
+        bm_feed(stream, fc->data + done, count);
+        done += count;
+
+        if (fuzz_below(state, 4U) == 0U)
+            bm_stream_flush(stream);
+    }
+
+    bm_stream_finish(stream);
+    bm_stream_free(stream);
+}
+
+/* Writes the data of the case to the pipe in chunks of random sizes. */
+struct fuzz_writer {
+    const struct fuzz_case *fc;
+    int fd;
+    uint64_t state;
+};
+
+static void *write_chunks(void *arg)
+{
+    struct fuzz_writer *fw = arg;
+    size_t max_chunk = 1U + fuzz_below(&fw->state, 3U * STREAM_CHUNK_SIZE);
+    size_t done = 0U;
+
+    while (done < fw->fc->size) {
+        size_t count = 1U + fuzz_below(&fw->state, max_chunk);
+        ssize_t nr_written;
+
+        if (count > fw->fc->size - done)
+            count = fw->fc->size - done;
+
+        /* Fails once the scan has stopped and closed the pipe. */
+        if ((nr_written = write(fw->fd, fw->fc->data + done, count)) < 0)
+            break;
+
+        done += (size_t) nr_written;
+    }
+
+    close(fw->fd);
+    return NULL;
+}
+
+/* Runs the pipelined scan of the program over the pipe fed by
+   a separate thread, stopping after a random number of matches
+   in half of the runs. */
+static void check_pipelined(const struct bm_pattern *pat,
+                            const struct fuzz_case *fc,
+                            const char *engine,
+                            uint64_t *state,
+                            const struct fuzz_sink *expected)
+{
+    struct fuzz_writer fw;
+    struct fuzz_sink fs;
+    struct run_stats rs;
+    pthread_t writer;
+    int fds[2];
+
+    /* The writer gets an error instead of the signal
+       once the scan stops early. */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(fds) != 0) {
+        perror("Failed to create the pipe");
+        exit(BM_IO_ERR);
+    }
+
+    fw.fc = fc;
+    fw.fd = fds[1];
+    fw.state = fuzz_random(state) | 1U;
+    if (pthread_create(&writer, NULL, write_chunks, &fw) != 0) {
+        fprintf(stderr, "Failed to start the writer of the pipe\n");
+        exit(BM_IO_ERR);
+    }
+
+    init_sink(&fs);
+    if (fuzz_below(state, 2U) != 0U)
+        fs.limit = 1U + fuzz_below(state, 4U);
+    memset(&rs, 0, sizeof(rs));
+    scan_pipelined(pat, fds[0], &fs.sink, &rs);
+
+    close(fds[0]);
+    pthread_join(writer, NULL);
+
+    check_stopped(fc, engine, "pipelined", &fs, expected);
+}
+
+static const struct fuzz_engine {
+    const char *name;
+    int (*use)(struct bm_pattern *pat);
+} fuzz_engines[] = {
+    { "chosen",      use_auto           },
+    { "rabin-karp",  use_rabin_karp     },
+    { "shift-and",   use_shift_and      },
+    { "shift-long",  use_long_shift_and },
+    { "hamming-all", use_hamming_all    },
+    { "prefilter",   use_prefilter      },
+    { "horspool",    use_horspool       },
+    { "simd-sse2",   use_simd_sse2      },
+    { "simd-avx2",   use_simd_avx2      },
+    { "simd-avx512", use_simd_avx512    },
+};
+
+/* Compiles the patterns of @fc. */
+static struct bm_pattern *compile_case(const struct fuzz_case *fc)
+{
+    struct bm_pattern *pat;
+    char *hex_seqs[FUZZ_MAX_PATTERNS], *mask_seq = NULL, err[256];
+    size_t i;
+    int ret_val;
+
+    for (i = 0U; i < fc->nr_patterns; i++)
+        hex_seqs[i] = to_hex(fc->patterns[i], fc->nr_bits[i]);
+
+    if (fc->nr_patterns > 1U) {
+        ret_val = bm_compile_set((const char *const *) hex_seqs,
+                                 fc->nr_bits,
+                                 fc->nr_patterns,
+                                 &pat,
+                                 err,
+                                 sizeof(err));
+    } else {
+        if (fc->mask != NULL)
+            mask_seq = to_hex(fc->mask, fc->nr_bits[0]);
+
+        ret_val = bm_compile(hex_seqs[0],
+                             fc->nr_bits[0],
+                             mask_seq,
+                             fc->max_errors,
+                             &pat,
+                             err,
+                             sizeof(err));
+    }
+
+    for (i = 0U; i < fc->nr_patterns; i++)
+        free(hex_seqs[i]);
+    free(mask_seq);
+
+    if (ret_val != BM_OK) {
+        fprintf(stderr, "%s\n", err);
+        print_case(fc);
+        abort();
+    }
+
+    return pat;
+}
+
+/* Checks every engine able to handle the case in every way of scanning. */
+static void check_case(const struct fuzz_case *fc)
+{
+    struct fuzz_sink expected;
+    size_t i;
+
+    find_naive(fc, &expected);
+
+    for (i = 0U; i < sizeof(fuzz_engines) / sizeof(fuzz_engines[0]); i++) {
+        const struct fuzz_engine *engine = &fuzz_engines[i];
+        struct bm_pattern *pat = compile_case(fc);
+        struct fuzz_sink fs;
+        uint64_t state = fc->seed | 1U;
+        int ret_val;
+
+        if ((ret_val = engine->use(pat)) != BM_OK) {
+            bm_free(pat);
+            if (ret_val == BM_NOT_FOUND)
+                continue;
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(BM_NO_MEM);
+        }
+
+        if (fc->size * 8U >= bm_min_bits(pat)) {
+            size_t nr_counted = 0U;
+
+            init_sink(&fs);
+            bm_scan(pat, fc->data, 0U, fc->size * 8U, &fs.sink);
+            check_matches(fc, engine->name, "whole", &fs, &expected);
+
+            init_sink(&fs);
+            scan_sliced(pat, fc, &state, &fs.sink);
+            check_matches(fc, engine->name, "sliced", &fs, &expected);
+
+            check_range(pat, fc, engine->name, &state, &expected);
+            check_parallel(pat, fc, engine->name, &state, &expected);
+
+            /* The engines with dedicated routine count the matches
+               without reporting them. */
+            init_sink(&fs);
+            fs.sink.nr_counted = &nr_counted;
+            bm_scan(pat, fc->data, 0U, fc->size * 8U, &fs.sink);
+            if (nr_counted + fs.nr_matches != expected.nr_matches) {
+                fprintf(stderr,
+                        "%s engine counted %zu matches instead of %zu\n",
+                        engine->name,
+                        nr_counted + fs.nr_matches,
+                        expected.nr_matches);
+                print_case(fc);
+                abort();
+            }
+            free(fs.matches);
+        }
+
+        init_sink(&fs);
+        scan_chunked(pat, fc, &state, &fs.sink);
+        check_matches(fc, engine->name, "chunked", &fs, &expected);
+
+        check_pipelined(pat, fc, engine->name, &state, &expected);
+
+        bm_free(pat);
+    }
+
+    free(expected.matches);
+}
+
+/* Builds the case from arbitrary @input of @size bytes.
+   The first 8 bytes seed the choice of the kind of the case and
+   the lengths of the patterns. The patterns and the mask come next
+   and the rest of the input is the data. Missing bytes are zeros. */
+static void decode_case(struct fuzz_case *fc,
+                        const unsigned char *input,
+                        size_t size)
+{
+    uint64_t state = 0U;
+    size_t i, nr_used = 8U, count;
+    unsigned int kind;
+
+    memset(fc, 0, sizeof(*fc));
+
+    for (i = 0U; i < 8U && i < size; i++)
+        state = state << 8U | input[i];
+
+    fc->seed = state;
+    state |= 1U;
+    kind = (unsigned int) fuzz_below(&state, 8U);
+
+    /* Sets, approximate and masked patterns take a quarter
+       of the cases each. */
+    fc->nr_patterns = kind < 2U ? 2U + fuzz_below(&state, 3U) : 1U;
+
+    for (i = 0U; i < fc->nr_patterns; i++) {
+        /* Short patterns are the most interesting ones. */
+        size_t limit = fuzz_below(&state, 4U) != 0U ? 80U : FUZZ_MAX_BITS;
+
+        fc->nr_bits[i] = 1U + fuzz_below(&state, limit);
+        fc->patterns[i] = fuzz_alloc((fc->nr_bits[i] + 7U) / 8U);
+
+        count = (fc->nr_bits[i] + 7U) / 8U;
+        if (nr_used < size)
+            memcpy(fc->patterns[i],
+                   input + nr_used,
+                   size - nr_used < count ? size - nr_used : count);
+        nr_used += count;
+    }
+
+    if (kind == 2U || kind == 3U)
+        fc->max_errors = 1U + fuzz_below(&state, fc->nr_bits[0] / 4U + 2U);
+
+    if (kind == 4U || kind == 5U || (kind == 2U && fuzz_below(&state, 2U))) {
+        count = (fc->nr_bits[0] + 7U) / 8U;
+        fc->mask = fuzz_alloc(count);
+        if (nr_used < size)
+            memcpy(fc->mask,
+                   input + nr_used,
+                   size - nr_used < count ? size - nr_used : count);
+        nr_used += count;
+    }
+
+    if (nr_used < size) {
+        fc->data = input + nr_used;
+        fc->size = size - nr_used;
+    } else {
+        fc->data = input;
+        fc->size = 0U;
+    }
+}
+
+static void free_case(struct fuzz_case *fc)
+{
+    size_t i;
+
+    for (i = 0U; i < fc->nr_patterns; i++)
+        free(fc->patterns[i]);
+
+    free(fc->mask);
+}
+
+#ifdef FUZZ_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct fuzz_case fc;
+
+    decode_case(&fc, data, size);
+    check_case(&fc);
+    free_case(&fc);
+
+    return 0;
+}
+#else
+/* Generates the input of the case from @seed. The data is random,
+   sparse, periodic, zeros or consists of the copies of the pattern,
+   so that the matches and near-misses are frequent. */
+static unsigned char *generate_input(uint64_t seed, size_t *psize)
+{
+    uint64_t state = seed | 1U;
+    struct fuzz_case fc;
+    unsigned char *input, header[8];
+    size_t size, header_size, nr_bits, i;
+    unsigned int mode;
+
+    for (i = 0U; i < 8U; i++)
+        header[i] = (unsigned char) (seed >> (56U - 8U * i));
+
+    /* The header alone tells the sizes of the patterns and the mask. */
+    decode_case(&fc, header, 8U);
+    header_size = 8U;
+    for (i = 0U; i < fc.nr_patterns; i++)
+        header_size += (fc.nr_bits[i] + 7U) / 8U;
+    if (fc.mask != NULL)
+        header_size += (fc.nr_bits[0] + 7U) / 8U;
+    nr_bits = fc.nr_bits[0];
+
+    mode = (unsigned int) fuzz_below(&state, 5U);
+    /* Zeros nearly match the patterns at every offset, so
+       the naive search takes too long unless the data is short. */
+    if (fuzz_below(&state, 8U) != 0U || mode == 3U)
+        size = header_size + fuzz_below(&state, 2000U);
+    else
+        size = header_size + fuzz_below(&state, FUZZ_MAX_SIZE);
+    free_case(&fc);
+
+    input = fuzz_alloc(size);
+    memcpy(input, header, 8U);
+
+    for (i = 8U; i < size; i++) {
+        switch (mode) {
+        case 0:
+            input[i] = (unsigned char) fuzz_random(&state);
+            break;
+        case 1:
+            input[i] = fuzz_below(&state, 8U) == 0U ?
+                       (unsigned char) (0x80U >> fuzz_below(&state, 8U)) : 0U;
+            break;
+        case 2:
+            input[i] = (unsigned char) (seed >> (8U * (i % 3U)));
+            break;
+        case 3:
+            input[i] = 0U;
+            break;
+        default:
+            /* The data repeats the first pattern with occasional
+               bit flips. */
+            input[i] = i < header_size ?
+                       (unsigned char) fuzz_random(&state) :
+                       input[8U + (i - header_size) %
+                             (header_size - 8U)];
+            if (fuzz_below(&state, 64U) == 0U)
+                input[i] ^= (unsigned char) (1U << fuzz_below(&state, 8U));
+            break;
+        }
+    }
+
+    /* The first pattern ends with the only set bit, so each of its
+       prefixes matches the zeros everywhere. */
+    if (mode == 3U)
+        input[8U + (nr_bits - 1U) / 8U] =
+            (unsigned char) (0x80U >> ((nr_bits - 1U) % 8U));
+
+    *psize = size;
+    return input;
+}
+
+/* Checks the case decoded from the file at @path. */
+static int check_file(const char *path)
+{
+    FILE *file;
+    unsigned char *input = NULL;
+    size_t size = 0U, capacity = 0U;
+    struct fuzz_case fc;
+
+    if ((file = fopen(path, "rb")) == NULL) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to open %s: %s\n",
+                path,
+                strerror(errno));
+        return BM_IO_ERR;
+    }
+
+    while (1) {
+        size_t nr_read;
+
+        if (size == capacity) {
+            capacity = capacity != 0U ? capacity * 2U : 65536U;
+            if ((input = realloc(input, capacity)) == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(BM_NO_MEM);
+            }
+        }
+
+        if ((nr_read = fread(input + size, 1U, capacity - size, file)) == 0U)
+            break;
+
+        size += nr_read;
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr,
+                "I/O error: "
+                "Failed to read %s\n",
+                path);
+        fclose(file);
+        free(input);
+        return BM_IO_ERR;
+    }
+
+    fclose(file);
+
+    decode_case(&fc, input, size);
+    check_case(&fc);
+    free_case(&fc);
+    free(input);
+
+    return EXIT_SUCCESS;
+}
+
+static void fuzz_usage(void)
+{
+    fprintf(stderr,
+            "USAGE: fuzz [-n <cases nr>] [-S <seed>]\n"
+            "       fuzz <file>\n"
+            "where\n"
+            "    -n <cases nr> - number of the generated cases "
+            "(default %u)\n"
+            "    -S <seed>     - seed of the first case, the following ones "
+            "take the next seeds\n"
+            "    <file>        - check the single case decoded "
+            "from the file\n",
+            FUZZ_NR_CASES);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long seed = 1U, nr_cases = FUZZ_NR_CASES, i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:S:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_cases = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fuzz_usage();
+            return BM_USAGE_ERR;
+        }
+    }
+
+    if (argc - optind == 1)
+        return check_file(argv[optind]);
+    else if (argc != optind) {
+        fuzz_usage();
+        return BM_USAGE_ERR;
+    }
+
+    for (i = 0U; i < nr_cases; i++) {
+        struct fuzz_case fc;
+        unsigned char *input;
+        size_t size;
+
+        input = generate_input((uint64_t) (seed + i), &size);
+        decode_case(&fc, input, size);
+        check_case(&fc);
+        free_case(&fc);
+        free(input);
+    }
+
+    printf("%llu cases passed\n", nr_cases);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,2816 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmatch.h"
+
+/* Vectorized candidate search is available on x86 with GCC-compatible
+   compilers which can build code for particular instruction set
+   extensions and tell whether the running CPU supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Mersenne prime 2 ** 61 - 1 used in hash function.
+   Reduction modulo this number takes only shifts and additions
+   because 2 ** 61 == 1 (mod PRIME_NUM).
+   Change of the prime number requires change of hash_reduce(),
+   hash_shift() and initializer below because they are related. */
+#define PRIME_BITS 61U
+#define PRIME_NUM ((UINT64_C(1) << PRIME_BITS) - 1U)
+/* 2 ** -1 mod (2 ** 61 - 1).
+   This initializer is chosen so we can compute 2 ** (nr_bits - 1) by
+   applying shifting and modulo reduction operations in a loop. */
+#define INIT_RNUM (UINT64_C(1) << (PRIME_BITS - 1U))
+
+/* Patterns of this many bits or less are looked for by shift-and engine. */
+#define SHIFT_AND_MAX_BITS 64U
+/* Shift-and state needs 7 extra bits to report matches ending at
+   any bit of the consumed byte. So the state of the automaton
+   recognizing more pattern bits than this spans two words. */
+#define SHIFT_AND_WORD_BITS (SHIFT_AND_MAX_BITS - 7U)
+/* The engines specialised for a pattern length consume as many bytes
+   at once as the state has room for the matches ending in them,
+   given the length of the part of the pattern recognized by the automaton.
+   Two word state is advanced a byte at a time. */
+#define SHIFT_AND_STEP(nr_sa_bits)                             \
+    ((nr_sa_bits) <= SHIFT_AND_WORD_BITS ?                     \
+     (SHIFT_AND_WORD_BITS + 8U - (nr_sa_bits)) / 8U : 1U)
+/* The window of the automaton over a long masked pattern is chosen
+   by its fixed bits. A change between adjacent fixed bits counts as
+   this many of them: it is about as unlikely within the runs of
+   16 equal bits, which are common in real data. */
+#define SHIFT_AND_CHANGE_WEIGHT 4U
+/* The hits of the window of a long masked pattern are verified until
+   too many of them are rejected, see FILTER_BASE_FAILURES below.
+   Then the automaton recognizing the whole pattern takes over.
+   Its state is kept on the stack and its masks take 2 KiB
+   per 64 pattern bits, so it is built for the patterns up to
+   this many bits only. */
+#define SHIFT_AND_LONG_MAX_BITS 16384U
+#define SHIFT_AND_LONG_MAX_WORDS ((SHIFT_AND_LONG_MAX_BITS + 7U + 63U) / 64U)
+
+/* Engines which verify candidates found by some filter give up
+   and hand the rest of the input to an engine running in linear time
+   once the number of rejected candidates exceeds
+   this base plus one per FILTER_FAILURE_RATIO bytes scanned.
+   The fuzzer lowers the limits marked as overridable below,
+   so that the paths they guard are taken on small inputs. */
+#ifndef FILTER_BASE_FAILURES
+#define FILTER_BASE_FAILURES 1024U
+#endif
+#define FILTER_FAILURE_RATIO 32U
+
+/* The skipping engine gives up once the number of the windows it has
+   looked at exceeds FILTER_BASE_FAILURES plus one per this many bytes
+   scanned, since the other engines are faster on such data. */
+#define HORSPOOL_MIN_SHIFT 32U
+/* Unmasked patterns of this many bits or more are looked for by
+   the skipping engine, see init_horspool(). Its window of hp_len bytes
+   is (nr_bits + 1) / 8 - 1 bytes at the shortest, and the longest
+   shift, hp_len - 1 bytes, must reach HORSPOOL_MIN_SHIFT. Otherwise
+   the engine runs out of windows even where nothing matches.
+   The shifts are at most HORSPOOL_MAX_SHIFT bytes, so they fit
+   the byte table. */
+#define HORSPOOL_MIN_BITS (8U * (HORSPOOL_MIN_SHIFT + 2U) - 1U)
+#define HORSPOOL_MAX_SHIFT 255U
+/* The input this many bytes ahead of the window is prefetched, so
+   the shifts too long for the hardware prefetcher don't stall
+   on each cache line. */
+#define HORSPOOL_PREFETCH 1024U
+
+/* Approximate matching engine filters the candidates by at most this many
+   bits of the pattern. */
+#define HAMMING_WINDOW_BITS 64U
+/* Once the filter fails, the errors are counted at every position,
+   and whether any of 8 positions may still match is checked
+   after each this many 64-bit words of the pattern. */
+#define HAMMING_CHECK_WORDS 4U
+
+/* Vectorized engine looks for the first SIMD_PREFIX_BITS bits of
+   the pattern. The pattern must be at least that long. */
+#define SIMD_PREFIX_BITS 16U
+
+/* bm_feed() scans the data in pieces of this many bytes, so the buffer
+   of the stream doesn't depend on the amount of data fed at once.
+   Overridable. */
+#ifndef FEED_CHUNK_SIZE
+#define FEED_CHUNK_SIZE 65536U
+#endif
+
+/* Automaton recognizing a set of patterns steps through the input
+   a byte at a time while it is in one of this many shallowest states.
+   The byte transition table takes 1 KiB per state. Overridable. */
+#ifndef AUTOMATON_TABLE_MAX_STATES
+#define AUTOMATON_TABLE_MAX_STATES 16384U
+#endif
+/* Set in byte transitions of the automaton if some pattern ends
+   at any bit of the consumed byte. */
+#define AUTOMATON_HIT (UINT32_C(1) << 31)
+/* Upper limit for the number of states of the automaton. */
+#define AUTOMATON_MAX_STATES (AUTOMATON_HIT - 1U)
+/* Marks the end of the list of patterns ending at a state. */
+#define NO_MEMBER UINT32_MAX
+
+/* Extracts @count bits starting at @offset.
+   May traverse byte & word boundaries.
+   In a byte, the most significant bit has the least offset. */
+static unsigned int extract_bitfield(const unsigned char *buf,
+                                     size_t offset,
+                                     size_t count)
+{
+    unsigned int val = 0U;
+
+    assert(0U < count && count <= 8U);
+
+    while (count > 0U) {
+        size_t nr_avail, nr_consumed, nr_left;
+        unsigned int part, mask;
+
+        /* How many bits can be consumed in the current byte? */
+        nr_avail = 8U - (offset & 7U);
+        /* And how many bits are we supposed to consume? */
+        nr_consumed = count < nr_avail ? count : nr_avail;
+        /* Amount of the least significant bits in the current byte
+           which are next to consume. */
+        nr_left = nr_avail - nr_consumed;
+
+        part = buf[offset / 8U];
+        mask = ~((-1U << nr_avail) | ~(-1U << nr_left));
+
+        val = (val << nr_consumed) | ((part & mask) >> nr_left);
+
+        count -= nr_consumed;
+        offset += nr_consumed;
+    }
+
+    return val;
+}
+
+/* Loads @count bits starting at @offset to the most significant bits
+   of the word, so the bit of the least offset is the most significant one.
+   Only the bytes the bits span are read. The rest of the word is garbage
+   from these bytes, so the caller masks it out. */
+static uint64_t load_bits(const unsigned char *buf,
+                          size_t offset,
+                          size_t count)
+{
+    const unsigned char *p = buf + offset / 8U;
+    unsigned int shift = (unsigned int) (offset & 7U);
+    size_t i, nr_bytes = (shift + count + 7U) / 8U;
+    uint64_t word = 0U;
+
+    assert(0U < count && count <= 64U);
+
+    if (nr_bytes < 8U) {
+        for (i = 0U; i < nr_bytes; i++)
+            word |= (uint64_t) p[i] << (56U - 8U * i);
+
+        return word << shift;
+    }
+
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    word <<= shift;
+
+    /* The bits span 9 bytes. */
+    if (nr_bytes > 8U)
+        word |= (uint64_t) p[8] >> (8U - shift);
+
+    return word;
+}
+
+/* Passes the match of the pattern @member of the set found at @pos to @sink.
+   Returns non-zero if the scan should stop. */
+static int report_member(struct bm_sink *sink, size_t pos, size_t member)
+{
+    if (sink->report(sink, pos, member))
+        sink->stopped = 1;
+
+    return sink->stopped;
+}
+
+/* Passes the match of a single pattern found at @pos to @sink.
+   Returns non-zero if the scan should stop. */
+static int report_match(struct bm_sink *sink, size_t pos)
+{
+    return report_member(sink, pos, 0U);
+}
+
+/* Accounts for the position passed by the filter of the engine
+   to verification. @result tells whether the position matched. */
+static void count_verified(struct bm_sink *sink, int result)
+{
+    if (sink->stats != NULL) {
+        sink->stats->nr_verified++;
+        if (result != BM_FOUND)
+            sink->stats->nr_rejected++;
+    }
+}
+
+/* The pattern as it appears in the byte stream when it starts
+   at particular bit offset (phase) within a byte. */
+struct bit_phase {
+    /* The pattern shifted right by the phase. */
+    unsigned char *buf;
+    /* 1 if the first byte of the buffer is covered partially, 0 otherwise. */
+    size_t head;
+    /* The amount of bytes covered by the pattern entirely. */
+    size_t len;
+    /* Relevant bits of the partially covered bytes before and
+       after the entire ones. Zero mask means there is no such byte. */
+    unsigned int head_mask;
+    unsigned int tail_mask;
+};
+
+/* Reduces @val modulo PRIME_NUM.
+   The first step leaves at most PRIME_NUM + 7 for any 64-bit @val. */
+static uint64_t hash_reduce(uint64_t val)
+{
+    val = (val & PRIME_NUM) + (val >> PRIME_BITS);
+
+    return val >= PRIME_NUM ? val - PRIME_NUM : val;
+}
+
+/* Appends @count bits of @bits to the bit string hashed to @hash, that is
+   computes (@hash * 2 ** @count + @bits) mod PRIME_NUM.
+   The bits shifted out past 2 ** 61 wrap around to the least significant
+   ones. */
+static uint64_t hash_shift(uint64_t hash, size_t count, unsigned int bits)
+{
+    assert(hash < PRIME_NUM && 0U < count && count <= 8U);
+
+    return hash_reduce(((hash << count) & PRIME_NUM) +
+                       (hash >> (PRIME_BITS - count)) +
+                       bits);
+}
+
+/* Bit-level Aho–Corasick automaton recognizing any pattern of a set.
+   Its states are the prefixes of the patterns, 0 being the empty one.
+   See init_automaton(). */
+struct bit_automaton {
+    size_t nr_states;
+    /* The state following the state S on input bit B is delta[2 * S + B]. */
+    uint32_t *delta;
+    /* The state following the state S on input byte V is delta8[256 * S + V]
+       possibly combined with AUTOMATON_HIT. The states are numbered
+       in breadth-first order and only the first nr_table_states of them,
+       the shallowest ones, have such transitions. */
+    uint32_t *delta8;
+    size_t nr_table_states;
+    /* The first pattern which equals the prefix of the state, or NO_MEMBER.
+       The patterns equal to each other are chained by same[]. */
+    uint32_t *first;
+    uint32_t *same;
+    /* The longest proper suffix of the state's prefix which equals
+       some pattern, or 0 if there is no such suffix. */
+    uint32_t *suffix;
+};
+
+struct bm_pattern {
+    /* Buffer holding particular bit pattern. */
+    unsigned char *buf;
+    /* Capacity of the allocated buffer. */
+    size_t size;
+    /* The amount of relevant bits in the buffer.
+       For a set of patterns, the length of the longest one. */
+    size_t nr_bits;
+    /* The length of the shortest pattern of the set.
+       Equals nr_bits for a single pattern. */
+    size_t min_bits;
+    /* The bits of the pattern which must match the data, so the others
+       match any data. NULL if all bits must match.
+       The pattern bits outside the mask are cleared. */
+    unsigned char *mask;
+    /* The pattern and its mask packed into nr_words 64-bit words
+       by load_bits(). The mask bits past the pattern are cleared. */
+    uint64_t *words;
+    uint64_t *word_masks;
+    size_t nr_words;
+    /* Pre-computed hash value of the pattern. */
+    uint64_t hash;
+    /* Cancel the effect of top-most bit on hash value by adding this number to
+       the current hash sum. */
+    uint64_t rnum;
+    /* Cancel the effect of up to 8 top-most bits forming the value V
+       by adding rk_out[V]. That is -(V * 2 ** nr_bits) mod PRIME_NUM. */
+    uint64_t rk_out[256];
+    /* Indexed by two adjacent input bytes. Bit K (1 <= K <= 7) is set if
+       the last min(nr_bits, 8) pattern bits end K bits into the latter byte. */
+    unsigned char *rk_tails;
+    /* The number of the bytes covered by the pattern entirely
+       at any phase, and the skipping engine's shifts indexed
+       by two adjacent input bytes. See init_horspool(). */
+    size_t hp_len;
+    unsigned char *hp_shifts;
+    /* Search engine suitable for the pattern. */
+    int (*engine)(const struct bm_pattern *pat,
+                  const unsigned char *buf,
+                  size_t offset,
+                  size_t end,
+                  struct bm_sink *sink);
+    /* Counts overlapping matches without reporting them one by one.
+       NULL if the engine has no dedicated routine for that. */
+    size_t (*counter)(const struct bm_pattern *pat,
+                      const unsigned char *buf,
+                      size_t offset,
+                      size_t end);
+    /* The amount of pattern bits recognized by shift-and automaton
+       and the offset of the first of them. */
+    size_t nr_sa_bits;
+    size_t sa_offset;
+    /* Shift-and transition masks indexed by input byte.
+       The second set holds the bits of the two word state above
+       the first 64 ones. */
+    uint64_t sa_masks[256];
+    uint64_t sa_masks_hi[256];
+    /* Shift-and transition masks for the whole pattern, nr_sa_long_words
+       words per input byte. NULL unless the pattern is long and masked.
+       See init_long_shift_and(). */
+    uint64_t *sa_long_masks;
+    size_t nr_sa_long_words;
+    /* The amount of differing bits allowed within an approximate match.
+       0 if the match must be exact. */
+    size_t max_errors;
+    /* The window of hd_bits pattern bits starting at hd_offset
+       checked by approximate matching filter. It spans at most hd_len
+       bytes at any phase. See init_hamming() for the tables. */
+    size_t hd_offset;
+    size_t hd_bits;
+    size_t hd_len;
+    uint64_t *hd_tables;
+    uint64_t hd_bias;
+    /* The pattern for each of 8 possible bit offsets within a byte. */
+    struct bit_phase phases[8];
+    /* Engine which takes over the scan if the chosen one gives up. */
+    int (*fallback)(const struct bm_pattern *pat,
+                    const unsigned char *buf,
+                    size_t offset,
+                    size_t end,
+                    struct bm_sink *sink);
+    /* Engine which takes over the scan if the skipping one gives up. */
+    int (*hp_fallback)(const struct bm_pattern *pat,
+                       const unsigned char *buf,
+                       size_t offset,
+                       size_t end,
+                       struct bm_sink *sink);
+    /* Vector search routine supported by the CPU and
+       the amount of bytes it processes at once. */
+    size_t (*simd_find)(const struct bm_pattern *pat,
+                        const unsigned char *buf,
+                        size_t idx,
+                        size_t last,
+                        uint64_t *masks);
+    size_t simd_width;
+    /* The first SIMD_PREFIX_BITS bits of the pattern shifted to each phase.
+       They span 3 bytes, so only relevant bits of each byte are compared. */
+    unsigned char simd_vals[8][3];
+    unsigned char simd_masks[8][3];
+    /* Patterns of the set. NULL for a single pattern. */
+    struct bm_pattern *members;
+    size_t nr_members;
+    /* Recognizes the patterns of the set. */
+    struct bit_automaton *automaton;
+};
+
+static int scan_rabin_karp(const struct bm_pattern *pat,
+                           const unsigned char *buf,
+                           size_t offset,
+                           size_t end,
+                           struct bm_sink *sink);
+static int scan_prefilter(const struct bm_pattern *pat,
+                          const unsigned char *buf,
+                          size_t offset,
+                          size_t end,
+                          struct bm_sink *sink);
+static void use_shift_and_kernel(struct bm_pattern *pat);
+static int scan_long_shift_and(const struct bm_pattern *pat,
+                               const unsigned char *buf,
+                               size_t offset,
+                               size_t end,
+                               struct bm_sink *sink);
+static int scan_horspool(const struct bm_pattern *pat,
+                         const unsigned char *buf,
+                         size_t offset,
+                         size_t end,
+                         struct bm_sink *sink);
+static int scan_automaton(const struct bm_pattern *pat,
+                          const unsigned char *buf,
+                          size_t offset,
+                          size_t end,
+                          struct bm_sink *sink);
+static int scan_hamming(const struct bm_pattern *pat,
+                        const unsigned char *buf,
+                        size_t offset,
+                        size_t end,
+                        struct bm_sink *sink);
+static int scan_hamming_all(const struct bm_pattern *pat,
+                            const unsigned char *buf,
+                            size_t offset,
+                            size_t end,
+                            struct bm_sink *sink);
+#ifdef HAVE_SIMD
+static int scan_hamming_all_popcnt(const struct bm_pattern *pat,
+                                   const unsigned char *buf,
+                                   size_t offset,
+                                   size_t end,
+                                   struct bm_sink *sink);
+static int init_simd(struct bm_pattern *pat);
+static int scan_simd(const struct bm_pattern *pat,
+                     const unsigned char *buf,
+                     size_t offset,
+                     size_t end,
+                     struct bm_sink *sink);
+#endif
+
+/* Returns SHIFT_AND_CHANGE_WEIGHT if the fixed bit at @pos of the masked
+   pattern differs from the fixed bit before it, 0 otherwise. */
+static size_t fixed_change(const struct bm_pattern *pat, size_t pos)
+{
+    unsigned int bits;
+
+    if (pos == 0U || extract_bitfield(pat->mask, pos - 1U, 2) != 3U)
+        return 0U;
+
+    bits = extract_bitfield(pat->buf, pos - 1U, 2);
+    return bits == 1U || bits == 2U ? SHIFT_AND_CHANGE_WEIGHT : 0U;
+}
+
+/* Builds shift-and masks for nr_sa_bits bits of the pattern
+   followed by 7 wildcard bits. Bit I of the automaton state is set
+   if I + 1 initial bits of the extended pattern end at the current input bit.
+   The bits outside the pattern mask are wildcards too. The bits are
+   taken from the start of the pattern unless it is longer than
+   the automaton and masked. Then the window least likely to hit is taken,
+   so fewer candidates need verification. Its fixed bits and
+   the changes between them are counted, so it doesn't hit every run of
+   zeros or ones just because the pattern has long runs of them.
+   The state of up to SHIFT_AND_WORD_BITS pattern bits fits a word.
+   The longer one takes two words: bits 0 ... 63 are kept in the first one
+   and masked by sa_masks, the rest are kept in the second one and
+   masked by sa_masks_hi.
+   Each mask is a combination of 8 single bit steps, so the automaton
+   consumes the whole byte at once:
+     D' = ((D << 8) | 0xFF) & sa_masks[byte]
+   The wildcards keep matches ending at the inner bits of the byte
+   in the state, namely at bits nr_sa_bits - 1 ... nr_sa_bits + 6. */
+static void init_shift_and(struct bm_pattern *pat)
+{
+    /* Single bit step masks of the state words indexed by input bit. */
+    uint64_t bit_masks[2][2] = { { 0U, 0U }, { 0U, 0U } };
+    size_t pos, sum = 0U, best_score = 0U;
+    unsigned int i, j;
+
+    pat->nr_sa_bits = pat->nr_bits < SHIFT_AND_MAX_BITS ?
+                      pat->nr_bits : SHIFT_AND_MAX_BITS;
+    pat->sa_offset = 0U;
+
+    /* Each fixed bit scores 1 and each change between fixed bits
+       SHIFT_AND_CHANGE_WEIGHT. The sum counts the change into every bit
+       of the window, so the one into its first bit is left out. */
+    for (pos = 0U; pat->mask != NULL && pos < pat->nr_bits; pos++) {
+        sum += extract_bitfield(pat->mask, pos, 1) + fixed_change(pat, pos);
+        if (pos >= pat->nr_sa_bits)
+            sum -= extract_bitfield(pat->mask, pos - pat->nr_sa_bits, 1) +
+                   fixed_change(pat, pos - pat->nr_sa_bits);
+
+        if (pos + 1U >= pat->nr_sa_bits &&
+            sum - fixed_change(pat, pos + 1U - pat->nr_sa_bits) >
+            best_score) {
+            pat->sa_offset = pos + 1U - pat->nr_sa_bits;
+            best_score = sum - fixed_change(pat, pat->sa_offset);
+        }
+    }
+
+    for (i = 0U; i < 2U * SHIFT_AND_MAX_BITS; i++) {
+        uint64_t bit = (uint64_t) 1U << (i % SHIFT_AND_MAX_BITS);
+
+        pos = pat->sa_offset + i;
+
+        if (i < pat->nr_sa_bits &&
+            (pat->mask == NULL || extract_bitfield(pat->mask, pos, 1) != 0U)) {
+            bit_masks[extract_bitfield(pat->buf, pos, 1)]
+                     [i / SHIFT_AND_MAX_BITS] |= bit;
+        } else {
+            bit_masks[0][i / SHIFT_AND_MAX_BITS] |= bit;
+            bit_masks[1][i / SHIFT_AND_MAX_BITS] |= bit;
+        }
+    }
+
+    for (i = 0U; i < 256U; i++) {
+        uint64_t mask = ~(uint64_t) 0U, mask_hi = ~(uint64_t) 0U;
+
+        /* The most significant bit is consumed first,
+           so its step is shifted the most. The bits shifted out
+           of the first word go to the second one. */
+        for (j = 0U; j < 8U; j++) {
+            const uint64_t *bit_mask = bit_masks[(i >> j) & 1U];
+
+            mask &= (bit_mask[0] << j) | (((uint64_t) 1U << j) - 1U);
+            mask_hi &= (bit_mask[1] << j) |
+                       (j != 0U ? bit_mask[0] >> (SHIFT_AND_MAX_BITS - j) : 0U);
+        }
+
+        pat->sa_masks[i] = mask;
+        pat->sa_masks_hi[i] = mask_hi;
+    }
+}
+
+/* Builds shift-and masks for all the bits of the pattern followed by
+   7 wildcard bits the way init_shift_and() does for its window.
+   The state takes nr_sa_long_words words: word W holds bits
+   64 * W ... 64 * W + 63 of it, and is masked by
+   sa_long_masks[nr_sa_long_words * B + W] for input byte B. */
+static int init_long_shift_and(struct bm_pattern *pat)
+{
+    size_t nr_words = (pat->nr_bits + 7U + 63U) / 64U, i, w;
+    uint64_t *bit_masks, *masks;
+    unsigned int v, j;
+
+    assert(pat->nr_bits <= SHIFT_AND_LONG_MAX_BITS);
+
+    /* Single bit step masks for input bit 0 followed by the ones
+       for input bit 1. */
+    bit_masks = calloc(2U * nr_words, sizeof(*bit_masks));
+    masks = malloc(256U * nr_words * sizeof(*masks));
+    if (bit_masks == NULL || masks == NULL) {
+        free(masks);
+        free(bit_masks);
+        return BM_NO_MEM;
+    }
+
+    for (i = 0U; i < 64U * nr_words; i++) {
+        uint64_t bit = (uint64_t) 1U << (i % 64U);
+
+        if (i < pat->nr_bits &&
+            (pat->mask == NULL || extract_bitfield(pat->mask, i, 1) != 0U)) {
+            bit_masks[extract_bitfield(pat->buf, i, 1) * nr_words +
+                      i / 64U] |= bit;
+        } else {
+            bit_masks[i / 64U] |= bit;
+            bit_masks[nr_words + i / 64U] |= bit;
+        }
+    }
+
+    for (v = 0U; v < 256U; v++) {
+        for (w = 0U; w < nr_words; w++) {
+            uint64_t mask = ~(uint64_t) 0U;
+
+            /* The bits shifted out of the previous word come in,
+               and the first word gets ones. */
+            for (j = 0U; j < 8U; j++) {
+                const uint64_t *bit_mask = bit_masks +
+                                           ((v >> j) & 1U) * nr_words;
+
+                mask &= (bit_mask[w] << j) |
+                        (w == 0U ? ((uint64_t) 1U << j) - 1U :
+                         j != 0U ? bit_mask[w - 1U] >> (64U - j) : 0U);
+            }
+
+            masks[nr_words * v + w] = mask;
+        }
+    }
+
+    free(bit_masks);
+    pat->sa_long_masks = masks;
+    pat->nr_sa_long_words = nr_words;
+    return BM_OK;
+}
+
+/* Returns the number of set bits in @val. */
+static unsigned int popcount8(unsigned int val)
+{
+    val = (val & 0x55U) + ((val >> 1U) & 0x55U);
+    val = (val & 0x33U) + ((val >> 2U) & 0x33U);
+
+    return (val & 0x0FU) + (val >> 4U);
+}
+
+/* Builds the tables of approximate matching filter for the window of
+   hd_bits pattern bits. The window may start at any of 8 phases of
+   a byte and spans up to hd_len bytes. Lane PH (bits 8 * PH ... 8 * PH + 7)
+   of hd_tables[256 * I + V] is the number of window bits differing from V
+   if the window starts at bit PH of the byte preceding V by I bytes.
+   So the sum of hd_tables[256 * I + buf[S + I]] over all I holds
+   the distances from the window to the data starting at byte S
+   for 8 phases at once. A lane never exceeds HAMMING_WINDOW_BITS, so adding
+   hd_bias sets its top bit iff the distance exceeds max_errors.
+   Like init_shift_and(), the window is the start of the pattern
+   unless the pattern is longer and masked. */
+static int init_hamming(struct bm_pattern *pat)
+{
+    unsigned char vals[8][HAMMING_WINDOW_BITS / 8U + 2U];
+    unsigned char masks[8][HAMMING_WINDOW_BITS / 8U + 2U];
+    size_t pos, nr_fixed = 0U, most_fixed = 0U, i;
+    unsigned int ph, v, limit;
+
+    pat->hd_bits = pat->nr_bits < HAMMING_WINDOW_BITS ?
+                   pat->nr_bits : HAMMING_WINDOW_BITS;
+    pat->hd_offset = 0U;
+    pat->hd_len = (pat->hd_bits + 14U) / 8U;
+
+    for (pos = 0U; pat->mask != NULL && pos < pat->nr_bits; pos++) {
+        nr_fixed += extract_bitfield(pat->mask, pos, 1);
+        if (pos >= pat->hd_bits)
+            nr_fixed -= extract_bitfield(pat->mask, pos - pat->hd_bits, 1);
+
+        if (pos + 1U >= pat->hd_bits && nr_fixed > most_fixed) {
+            most_fixed = nr_fixed;
+            pat->hd_offset = pos + 1U - pat->hd_bits;
+        }
+    }
+
+    memset(vals, 0, sizeof(vals));
+    memset(masks, 0, sizeof(masks));
+
+    for (ph = 0U; ph < 8U; ph++) {
+        for (i = 0U; i < pat->hd_bits; i++) {
+            size_t bit = ph + i;
+            unsigned int shift = 7U - bit % 8U;
+
+            pos = pat->hd_offset + i;
+            if (pat->mask != NULL && extract_bitfield(pat->mask, pos, 1) == 0U)
+                continue;
+
+            masks[ph][bit / 8U] |= 1U << shift;
+            vals[ph][bit / 8U] |= extract_bitfield(pat->buf, pos, 1) << shift;
+        }
+    }
+
+    pat->hd_tables = malloc(pat->hd_len * 256U * sizeof(*pat->hd_tables));
+    if (pat->hd_tables == NULL)
+        return BM_NO_MEM;
+
+    for (i = 0U; i < pat->hd_len; i++) {
+        for (v = 0U; v < 256U; v++) {
+            uint64_t lanes = 0U;
+
+            for (ph = 0U; ph < 8U; ph++)
+                lanes |= (uint64_t) popcount8((v ^ vals[ph][i]) &
+                                              masks[ph][i]) << (8U * ph);
+
+            pat->hd_tables[256U * i + v] = lanes;
+        }
+    }
+
+    limit = pat->max_errors < HAMMING_WINDOW_BITS ?
+            (unsigned int) pat->max_errors : HAMMING_WINDOW_BITS;
+    pat->hd_bias = UINT64_C(0x0101010101010101) * (0x7FU - limit);
+    return BM_OK;
+}
+
+/* Builds the table of candidate positions within a byte for
+   byte-stepped Rabin–Karp engine. */
+static int init_rk_tails(struct bm_pattern *pat)
+{
+    unsigned int nr_tail, tail, i, k;
+
+    nr_tail = pat->nr_bits < 8U ? (unsigned int) pat->nr_bits : 8U;
+    tail = extract_bitfield(pat->buf, pat->nr_bits - nr_tail, nr_tail);
+
+    if ((pat->rk_tails = malloc(65536U)) == NULL)
+        return BM_NO_MEM;
+
+    for (i = 0U; i < 65536U; i++) {
+        unsigned int hits = 0U;
+
+        for (k = 1U; k < 8U; k++)
+            if (((i >> (8U - k)) & ~(-1U << nr_tail)) == tail)
+                hits |= 1U << k;
+
+        pat->rk_tails[i] = (unsigned char) hits;
+    }
+
+    return BM_OK;
+}
+
+/* Pre-computes 8 shifted copies of the pattern for byte-aligned prefilter.
+   All of them are placed to a single allocation owned by phases[0].
+   The pattern must be long enough to cover at least one byte entirely
+   at any phase, that is nr_bits >= 15. */
+static int init_prefilter(struct bm_pattern *pat)
+{
+    unsigned char *next;
+    unsigned int ph;
+    size_t i;
+
+    assert(pat->nr_bits >= 15U);
+
+    if ((next = malloc(8U * (pat->size + 1U))) == NULL)
+        return BM_NO_MEM;
+
+    for (ph = 0U; ph < 8U; ph++) {
+        struct bit_phase *phase = &pat->phases[ph];
+        unsigned int nr_tail = (ph + pat->nr_bits) % 8U;
+
+        phase->buf = next;
+        phase->head = ph != 0U;
+        phase->len = (ph + pat->nr_bits) / 8U - phase->head;
+        phase->head_mask = 0xFFU >> ph & -phase->head;
+        phase->tail_mask = 0xFFU << (8U - nr_tail) & 0xFFU;
+
+        for (i = 0U; i <= pat->size; i++) {
+            unsigned int prev = i > 0U ? pat->buf[i - 1U] : 0U;
+            unsigned int cur = i < pat->size ? pat->buf[i] : 0U;
+
+            next[i] = (unsigned char) (((prev << 8U | cur) >> ph) & 0xFFU);
+        }
+
+        next += pat->size + 1U;
+    }
+
+    return BM_OK;
+}
+
+/* Pre-computes the shifts of the skipping engine.
+   The engine slides a window of hp_len bytes over the input, and
+   the window is where the pattern covers hp_len bytes entirely
+   at every phase, taken from the first of them. So the window is
+   a candidate for 8 phases at once. Like Horspool algorithm does,
+   the engine looks at the last two bytes of the window only.
+   The window can be shifted by as many bytes as these two bytes
+   need to reach their rightmost occurrence in the shifted copies
+   of the pattern. If they don't occur there at all, the window is
+   shifted by hp_len - 1 bytes, i.e. by about nr_bits bits at once.
+   A zero shift means the two bytes end some copy,
+   so the phases ending with them are verified.
+   The shifted copies must be prepared by init_prefilter(). */
+static int init_horspool(struct bm_pattern *pat)
+{
+    unsigned int ph;
+    size_t j, shift;
+
+    pat->hp_len = SIZE_MAX;
+    for (ph = 0U; ph < 8U; ph++) {
+        if (pat->phases[ph].len < pat->hp_len)
+            pat->hp_len = pat->phases[ph].len;
+    }
+
+    assert(pat->hp_len >= 2U);
+
+    if ((pat->hp_shifts = malloc(65536U)) == NULL)
+        return BM_NO_MEM;
+
+    shift = pat->hp_len - 1U;
+    memset(pat->hp_shifts,
+           (int) (shift < HORSPOOL_MAX_SHIFT ? shift : HORSPOOL_MAX_SHIFT),
+           65536U);
+
+    for (ph = 0U; ph < 8U; ph++) {
+        const unsigned char *copy = pat->phases[ph].buf +
+                                    pat->phases[ph].head;
+
+        for (j = 0U; j + 1U < pat->hp_len; j++) {
+            unsigned int pair = (unsigned int) copy[j] << 8U | copy[j + 1U];
+
+            shift = pat->hp_len - 2U - j;
+            if (shift < pat->hp_shifts[pair])
+                pat->hp_shifts[pair] = (unsigned char) shift;
+        }
+    }
+
+    return BM_OK;
+}
+
+/* Builds the automaton recognizing the patterns of the set.
+   The patterns are put to a binary trie first. Then the failure link
+   of each state, that is its longest proper suffix which is a state too,
+   is found in breadth-first order, so the missing transitions can be
+   taken from the failure link whose transitions are complete already.
+   The total length of the patterns must be less than AUTOMATON_MAX_STATES. */
+static int init_automaton(struct bm_pattern *set)
+{
+    struct bit_automaton *ac;
+    uint32_t *fail, *queue, *order, *delta, *first, *suffix, *tmp, state;
+    size_t nr_states = 1U, head = 0U, tail = 0U, i, j;
+    int ret_val = BM_OK;
+
+    for (i = 0U; i < set->nr_members; i++)
+        nr_states += set->members[i].nr_bits;
+
+    assert(nr_states <= AUTOMATON_MAX_STATES);
+
+    if ((ac = calloc(1U, sizeof(*ac))) == NULL)
+        return BM_NO_MEM;
+
+    /* Partially built automaton is released along with the set. */
+    set->automaton = ac;
+
+    ac->delta = calloc(nr_states * 2U, sizeof(*ac->delta));
+    ac->first = malloc(nr_states * sizeof(*ac->first));
+    ac->suffix = malloc(nr_states * sizeof(*ac->suffix));
+    ac->same = malloc(set->nr_members * sizeof(*ac->same));
+    /* Temporary arrays. The last ones receive the renumbered states. */
+    fail = malloc(nr_states * sizeof(*fail));
+    queue = malloc(nr_states * sizeof(*queue));
+    delta = malloc(nr_states * 2U * sizeof(*delta));
+    first = malloc(nr_states * sizeof(*first));
+    suffix = malloc(nr_states * sizeof(*suffix));
+
+    if (ac->delta == NULL || ac->first == NULL || ac->suffix == NULL ||
+        ac->same == NULL || fail == NULL || queue == NULL ||
+        delta == NULL || first == NULL || suffix == NULL) {
+        ret_val = BM_NO_MEM;
+        goto out;
+    }
+
+    memset(ac->first, 0xFF, nr_states * sizeof(*ac->first));
+
+    /* Root is never a child, so zero transition means there is
+       no such child yet. Patterns are added in reverse order to keep
+       the chains of equal ones in increasing order. */
+    nr_states = 1U;
+    for (i = set->nr_members; i-- > 0U;) {
+        const struct bm_pattern *member = &set->members[i];
+
+        state = 0U;
+        for (j = 0U; j < member->nr_bits; j++) {
+            uint32_t *next = &ac->delta[2U * state +
+                                        extract_bitfield(member->buf, j, 1)];
+
+            if (*next == 0U)
+                *next = (uint32_t) nr_states++;
+            state = *next;
+        }
+
+        ac->same[i] = ac->first[state];
+        ac->first[state] = (uint32_t) i;
+    }
+
+    ac->nr_states = nr_states;
+
+    fail[0] = 0U;
+    ac->suffix[0] = 0U;
+    queue[tail++] = 0U;
+
+    while (head < tail) {
+        uint32_t cur = queue[head++];
+        unsigned int bit;
+
+        for (bit = 0U; bit < 2U; bit++) {
+            uint32_t next = ac->delta[2U * cur + bit];
+            uint32_t link = cur != 0U ? ac->delta[2U * fail[cur] + bit] : 0U;
+
+            if (next == 0U) {
+                ac->delta[2U * cur + bit] = link;
+                continue;
+            }
+
+            fail[next] = link;
+            ac->suffix[next] = ac->first[link] != NO_MEMBER ?
+                               link : ac->suffix[link];
+            queue[tail++] = next;
+        }
+    }
+
+    /* Renumber the states in breadth-first order. The scan spends most
+       of the time in the shallow states, so they get byte transitions. */
+    order = fail;
+    for (i = 0U; i < nr_states; i++)
+        order[queue[i]] = (uint32_t) i;
+
+    for (i = 0U; i < nr_states; i++) {
+        delta[2U * i] = order[ac->delta[2U * queue[i]]];
+        delta[2U * i + 1U] = order[ac->delta[2U * queue[i] + 1U]];
+        first[i] = ac->first[queue[i]];
+        suffix[i] = order[ac->suffix[queue[i]]];
+    }
+
+    /* The old arrays are released below. */
+    tmp = ac->delta;
+    ac->delta = delta;
+    delta = tmp;
+    tmp = ac->first;
+    ac->first = first;
+    first = tmp;
+    tmp = ac->suffix;
+    ac->suffix = suffix;
+    suffix = tmp;
+
+    ac->nr_table_states = nr_states < AUTOMATON_TABLE_MAX_STATES ?
+                          nr_states : AUTOMATON_TABLE_MAX_STATES;
+    ac->delta8 = malloc(ac->nr_table_states * 256U * sizeof(*ac->delta8));
+    if (ac->delta8 == NULL) {
+        ret_val = BM_NO_MEM;
+        goto out;
+    }
+
+    for (i = 0U; i < ac->nr_table_states; i++) {
+        for (j = 0U; j < 256U; j++) {
+            uint32_t hit = 0U;
+            unsigned int k;
+
+            state = (uint32_t) i;
+            for (k = 8U; k-- > 0U;) {
+                state = ac->delta[2U * state + ((j >> k) & 1U)];
+                if (ac->first[state] != NO_MEMBER ||
+                    ac->suffix[state] != 0U)
+                    hit = AUTOMATON_HIT;
+            }
+
+            ac->delta8[256U * i + j] = state | hit;
+        }
+    }
+
+out:
+    free(suffix);
+    free(first);
+    free(delta);
+    free(queue);
+    free(fail);
+    return ret_val;
+}
+
+void bm_free(struct bm_pattern *pat)
+{
+    size_t i;
+
+    if (pat == NULL)
+        return;
+
+    if (pat->automaton != NULL) {
+        free(pat->automaton->delta);
+        free(pat->automaton->delta8);
+        free(pat->automaton->first);
+        free(pat->automaton->same);
+        free(pat->automaton->suffix);
+        free(pat->automaton);
+    }
+
+    for (i = 0U; i < pat->nr_members; i++)
+        free(pat->members[i].buf);
+
+    free(pat->members);
+    free(pat->mask);
+    free(pat->hd_tables);
+    free(pat->sa_long_masks);
+    free(pat->words);
+    free(pat->rk_tails);
+    free(pat->hp_shifts);
+    free(pat->phases[0].buf);
+    free(pat->buf);
+    free(pat);
+}
+
+/* Puts the reason of the failure formatted as printf() does
+   to @err of @err_size bytes. Nothing is done if @err is NULL. */
+static void set_error(char *err, size_t err_size, const char *fmt, ...)
+{
+    va_list args;
+
+    if (err == NULL || err_size == 0U)
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(err, err_size, fmt, args);
+    va_end(args);
+}
+
+/* Converts the initial hex digits of @hex_seq holding @nr_bits bits
+   to binary data in @buf of (@nr_bits + 7) / 8 bytes.
+   @what names the sequence in error messages. */
+static int parse_hex(const char *hex_seq,
+                     size_t nr_bits,
+                     unsigned char *buf,
+                     const char *what,
+                     char *err,
+                     size_t err_size)
+{
+    unsigned char *next = buf;
+    /* 0 - if current character of the hex sequence is an upper half
+       of some byte;
+       1 - otherwise. */
+    int current_half = 0;
+
+    /* Do we have enough hex digits to satisfy bit requirement? */
+    if ((nr_bits + 3U) / 4U > strlen(hex_seq)) {
+        set_error(err,
+                  err_size,
+                  "Failed to parse the %s: "
+                  "Can\'t obtain %zu bits from the sequence",
+                  what,
+                  nr_bits);
+        return BM_INVALID_ARGS;
+    }
+
+    while (nr_bits > 0U) {
+        size_t count;
+        unsigned int val;
+
+        val = *hex_seq++;
+
+        if (val >= '0' && val <= '9')
+            val -= '0';
+        else if (val >= 'A' && val <= 'F')
+            val -= 'A' - 10;
+        else if (val >= 'a' && val <= 'f')
+            val -= 'a' - 10;
+        else {
+            set_error(err,
+                      err_size,
+                      "Failed to parse the %s: "
+                      "Invalid character at the position %zu",
+                      what,
+                      (size_t) (next - buf) * 2U + (size_t) current_half);
+            return BM_INVALID_ARGS;
+        }
+
+        count = nr_bits < 4U ? nr_bits : 4U;
+
+        if (!current_half)
+            *next = val << 4U;
+        else
+            *next++ |= val;
+
+        current_half = !current_half;
+        nr_bits -= count;
+    }
+
+    return BM_OK;
+}
+
+/* Unwrap textual representation of the pattern to binary data.
+   Ensure sanity of the resulting values.
+   Only the buffer and its size are filled in @pat. */
+static int parse_pattern(const char *hex_seq,
+                         size_t nr_bits,
+                         const char *what,
+                         struct bm_pattern *pat,
+                         char *err,
+                         size_t err_size)
+{
+    int ret_val;
+
+    if (nr_bits == 0U) {
+        /* Empty bit pattern matches any data at any offset */
+        set_error(err,
+                  err_size,
+                  "Failed to parse the %s: "
+                  "The pattern is empty",
+                  what);
+        return BM_INVALID_ARGS;
+    } else if (nr_bits > SIZE_MAX - 7U) {
+        /* This helps us to ensure no overflows happening later on */
+        set_error(err,
+                  err_size,
+                  "Failed to parse the %s: "
+                  "The number of bits exceeds imposed limit",
+                  what);
+        return BM_INVALID_ARGS;
+    }
+
+    pat->nr_bits = nr_bits;
+    pat->size = (nr_bits + 7U) / 8U;
+
+    if ((pat->buf = malloc(pat->size)) == NULL) {
+        set_error(err, err_size, "Failed to allocate memory");
+        return BM_NO_MEM;
+    }
+
+    ret_val = parse_hex(hex_seq, nr_bits, pat->buf, what, err, err_size);
+    if (ret_val != BM_OK) {
+        free(pat->buf);
+        pat->buf = NULL;
+    }
+
+    return ret_val;
+}
+
+/* Packs the pattern and its mask into words for match(). */
+static int init_words(struct bm_pattern *pat)
+{
+    size_t i, pat_offset, count;
+
+    pat->nr_words = (pat->nr_bits + 63U) / 64U;
+    pat->words = malloc(2U * pat->nr_words * sizeof(*pat->words));
+    if (pat->words == NULL)
+        return BM_NO_MEM;
+
+    pat->word_masks = pat->words + pat->nr_words;
+
+    for (i = 0U, pat_offset = 0U; i < pat->nr_words; i++, pat_offset += 64U) {
+        size_t nr_remained = pat->nr_bits - pat_offset;
+
+        count = nr_remained < 64U ? nr_remained : 64U;
+
+        pat->word_masks[i] = ~(uint64_t) 0U << (64U - count);
+        if (pat->mask != NULL)
+            pat->word_masks[i] &= load_bits(pat->mask, pat_offset, count);
+
+        pat->words[i] = load_bits(pat->buf, pat_offset, count) &
+                        pat->word_masks[i];
+    }
+
+    return BM_OK;
+}
+
+/* Chooses and prepares the engine suitable for the pattern @pat
+   whose bits and mask are parsed already. */
+static int init_engine(struct bm_pattern *pat)
+{
+    size_t offset, count;
+    unsigned int i;
+    int ret_val;
+
+    if ((ret_val = init_words(pat)) != BM_OK)
+        return ret_val;
+
+    pat->min_bits = pat->nr_bits;
+    pat->rnum = INIT_RNUM;
+    pat->hash = 0U;
+
+    for (offset = 0U; offset < pat->nr_bits; offset += count) {
+        size_t nr_remained = pat->nr_bits - offset;
+
+        count = nr_remained < 8U ? nr_remained : 8U;
+
+        pat->hash = hash_shift(pat->hash,
+                               count,
+                               extract_bitfield(pat->buf, offset, count));
+        pat->rnum = hash_shift(pat->rnum, count, 0U);
+    }
+
+    /* Multiples of 2 ** nr_bits for the bits leaving the window. */
+    pat->rk_out[0] = 0U;
+    pat->rk_out[1] = hash_shift(pat->rnum, 1U, 0U);
+    for (i = 2U; i < 256U; i++)
+        pat->rk_out[i] = hash_reduce(pat->rk_out[i - 1U] + pat->rk_out[1]);
+    for (i = 1U; i < 256U; i++)
+        pat->rk_out[i] = PRIME_NUM - pat->rk_out[i];
+
+    pat->rnum = PRIME_NUM - pat->rnum;
+
+    if (pat->max_errors != 0U) {
+        pat->engine = scan_hamming;
+        /* The errors are counted at every position if the filter fails. */
+        pat->fallback = scan_hamming_all;
+#ifdef HAVE_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("popcnt"))
+            pat->fallback = scan_hamming_all_popcnt;
+#endif
+        return init_hamming(pat);
+    }
+
+    /* Shift-and automaton takes don't care bits for wildcards,
+       so it handles masked patterns of any length. */
+    if (pat->nr_bits <= SHIFT_AND_MAX_BITS || pat->mask != NULL) {
+        init_shift_and(pat);
+        use_shift_and_kernel(pat);
+
+        if (pat->nr_sa_bits < pat->nr_bits &&
+            pat->nr_bits <= SHIFT_AND_LONG_MAX_BITS &&
+            (ret_val = init_long_shift_and(pat)) != BM_OK)
+            return ret_val;
+    } else {
+        /* Rabin–Karp engine takes over if the prefilter fails. */
+        if ((ret_val = init_rk_tails(pat)) != BM_OK)
+            return ret_val;
+        if ((ret_val = init_prefilter(pat)) != BM_OK)
+            return ret_val;
+        pat->engine = scan_prefilter;
+    }
+
+#ifdef HAVE_SIMD
+    /* Vector engine relies on the scalar one for the data
+       too short for vector loads. */
+    if (pat->nr_bits >= SIMD_PREFIX_BITS && init_simd(pat)) {
+        pat->fallback = pat->engine;
+        pat->engine = scan_simd;
+    }
+#endif
+
+    /* The skipping engine reads a fraction of the input
+       for long patterns unless it gives up. */
+    if (pat->nr_bits >= HORSPOOL_MIN_BITS && pat->mask == NULL) {
+        if ((ret_val = init_horspool(pat)) != BM_OK)
+            return ret_val;
+        pat->hp_fallback = pat->engine;
+        pat->engine = scan_horspool;
+    }
+
+    return BM_OK;
+}
+
+int bm_compile(const char *hex_seq,
+               size_t nr_bits,
+               const char *mask_seq,
+               size_t max_errors,
+               struct bm_pattern **ppat,
+               char *err,
+               size_t err_size)
+{
+    struct bm_pattern *pat;
+    size_t offset, nr_fixed = 0U;
+    int ret_val;
+
+    if ((pat = calloc(1U, sizeof(*pat))) == NULL) {
+        set_error(err, err_size, "Failed to allocate memory");
+        return BM_NO_MEM;
+    }
+
+    ret_val = parse_pattern(hex_seq,
+                            nr_bits,
+                            "bit sequence",
+                            pat,
+                            err,
+                            err_size);
+    if (ret_val != BM_OK)
+        goto fail;
+
+    if (mask_seq != NULL) {
+        if ((pat->mask = malloc(pat->size)) == NULL) {
+            ret_val = BM_NO_MEM;
+            goto fail;
+        }
+
+        ret_val = parse_hex(mask_seq,
+                            pat->nr_bits,
+                            pat->mask,
+                            "mask",
+                            err,
+                            err_size);
+        if (ret_val != BM_OK)
+            goto fail;
+
+        for (offset = 0U; offset < pat->size; offset++)
+            pat->buf[offset] &= pat->mask[offset];
+
+        for (offset = 0U; offset < pat->nr_bits; offset++)
+            nr_fixed += extract_bitfield(pat->mask, offset, 1);
+
+        /* The pattern without don't care bits needs no mask. */
+        if (nr_fixed == pat->nr_bits) {
+            free(pat->mask);
+            pat->mask = NULL;
+        }
+    }
+
+    pat->max_errors = max_errors;
+
+    if ((ret_val = init_engine(pat)) != BM_OK)
+        goto fail;
+
+    *ppat = pat;
+    return BM_OK;
+
+fail:
+    if (ret_val == BM_NO_MEM)
+        set_error(err, err_size, "Failed to allocate memory");
+    bm_free(pat);
+    return ret_val;
+}
+
+int bm_compile_set(const char *const *hex_seqs,
+                   const size_t *nr_bits,
+                   size_t nr_patterns,
+                   struct bm_pattern **ppat,
+                   char *err,
+                   size_t err_size)
+{
+    struct bm_pattern *set;
+    size_t i, nr_states = 1U;
+    /* Enough for the name of any pattern of the set. */
+    char what[64];
+    int ret_val;
+
+    if (nr_patterns == 0U) {
+        set_error(err,
+                  err_size,
+                  "Failed to parse the pattern set: "
+                  "No patterns given");
+        return BM_INVALID_ARGS;
+    }
+
+    if ((set = calloc(1U, sizeof(*set))) == NULL) {
+        set_error(err, err_size, "Failed to allocate memory");
+        return BM_NO_MEM;
+    }
+
+    set->members = calloc(nr_patterns, sizeof(*set->members));
+    if (set->members == NULL) {
+        ret_val = BM_NO_MEM;
+        goto fail;
+    }
+
+    set->min_bits = SIZE_MAX;
+
+    for (i = 0U; i < nr_patterns; i++) {
+        struct bm_pattern *member = &set->members[i];
+
+        snprintf(what, sizeof(what), "bit sequence of the pattern %zu", i);
+
+        ret_val = parse_pattern(hex_seqs[i],
+                                nr_bits[i],
+                                what,
+                                member,
+                                err,
+                                err_size);
+        if (ret_val != BM_OK)
+            goto fail;
+
+        set->nr_members++;
+
+        if (member->nr_bits >= AUTOMATON_MAX_STATES - nr_states) {
+            set_error(err,
+                      err_size,
+                      "Failed to parse the pattern set: "
+                      "The total number of bits exceeds imposed limit");
+            ret_val = BM_INVALID_ARGS;
+            goto fail;
+        }
+
+        nr_states += member->nr_bits;
+
+        if (member->nr_bits > set->nr_bits)
+            set->nr_bits = member->nr_bits;
+        if (member->nr_bits < set->min_bits)
+            set->min_bits = member->nr_bits;
+    }
+
+    if ((ret_val = init_automaton(set)) != BM_OK)
+        goto fail;
+
+    set->engine = scan_automaton;
+
+    *ppat = set;
+    return BM_OK;
+
+fail:
+    if (ret_val == BM_NO_MEM)
+        set_error(err, err_size, "Failed to allocate memory");
+    bm_free(set);
+    return ret_val;
+}
+
+size_t bm_min_bits(const struct bm_pattern *pat)
+{
+    return pat->min_bits;
+}
+
+size_t bm_max_bits(const struct bm_pattern *pat)
+{
+    return pat->nr_bits;
+}
+
+size_t bm_member_bits(const struct bm_pattern *pat, size_t member)
+{
+    if (pat->members == NULL)
+        return pat->nr_bits;
+
+    assert(member < pat->nr_members);
+
+    return pat->members[member].nr_bits;
+}
+
+/* Tries to match pattern to bit substring starting
+   at specific offset in memcmp-style, 64 bits at a time.
+   Only the bits within the pattern mask are compared.
+   The verification is accounted for in the statistics of @sink. */
+static int match(const struct bm_pattern *pat,
+                 const unsigned char *buf,
+                 size_t offset,
+                 struct bm_sink *sink)
+{
+    size_t i, pat_offset, count;
+    int ret_val = BM_FOUND;
+
+    for (i = 0U, pat_offset = 0U;
+         pat_offset < pat->nr_bits;
+         i++, pat_offset += count) {
+        size_t nr_remained = pat->nr_bits - pat_offset;
+
+        count = nr_remained < 64U ? nr_remained : 64U;
+
+        if (((load_bits(buf, offset + pat_offset, count) ^ pat->words[i]) &
+             pat->word_masks[i]) != 0U) {
+            ret_val = BM_NOT_FOUND;
+            break;
+        }
+    }
+
+    count_verified(sink, ret_val);
+    return ret_val;
+}
+
+/* Counts the bits within the pattern mask which differ from the data
+   starting at @offset. Counting stops once the count exceeds @limit.
+   The position is accounted for in the statistics of @sink
+   as verified one. */
+static size_t count_errors(const struct bm_pattern *pat,
+                           const unsigned char *buf,
+                           size_t offset,
+                           size_t limit,
+                           struct bm_sink *sink)
+{
+    size_t i, pat_offset, count, nr_errors = 0U;
+
+    for (i = 0U, pat_offset = 0U;
+         pat_offset < pat->nr_bits && nr_errors <= limit;
+         i++, pat_offset += count) {
+        size_t nr_remained = pat->nr_bits - pat_offset;
+        uint64_t diff;
+
+        count = nr_remained < 64U ? nr_remained : 64U;
+
+        diff = (load_bits(buf, offset + pat_offset, count) ^ pat->words[i]) &
+               pat->word_masks[i];
+        nr_errors += (size_t) __builtin_popcountll(diff);
+    }
+
+    count_verified(sink, nr_errors <= limit ? BM_FOUND : BM_NOT_FOUND);
+    return nr_errors;
+}
+
+/* Locate the positions where the data differs from the pattern
+   in at most max_errors bits without a filter. The errors at 8 phases
+   of a byte are counted at once: the data is loaded once for each
+   64 bits of the pattern and shifted to each phase. The counting stops
+   once each phase has more errors than allowed, which is checked
+   every HAMMING_CHECK_WORDS words. The positions where the loads would
+   pass the end of the data are checked by count_errors().
+   The engine takes over from scan_hamming() once too many positions
+   passing its filter are rejected.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits.
+   The body is inlined into the engines below, so the one for the CPUs
+   with popcnt instruction counts the bits by it. */
+__attribute__((always_inline))
+static inline int run_hamming_all(const struct bm_pattern *pat,
+                                  const unsigned char *buf,
+                                  size_t offset,
+                                  size_t end,
+                                  struct bm_sink *sink)
+{
+    size_t idx, avail = (end + 7U) / 8U, pos, i;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    /* Each word of the pattern is compared with 9 bytes of the data. */
+    for (idx = offset / 8U; avail - idx > 8U * pat->nr_words; idx++) {
+        size_t nr_errors[8] = { 0U, 0U, 0U, 0U, 0U, 0U, 0U, 0U };
+        unsigned int alive = 0xFFU, ph;
+
+        for (i = 0U; i < pat->nr_words && alive != 0U; i++) {
+            const unsigned char *p = buf + idx + 8U * i;
+            const uint64_t bits = pat->words[i], mask = pat->word_masks[i];
+            uint64_t word, next = p[8];
+
+            memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+
+            nr_errors[0] += (size_t) __builtin_popcountll((word ^ bits) & mask);
+#pragma GCC unroll 8
+            for (ph = 1U; ph < 8U; ph++)
+                nr_errors[ph] += (size_t) __builtin_popcountll(
+                    ((word << ph | next >> (8U - ph)) ^ bits) & mask);
+
+            if (i % HAMMING_CHECK_WORDS != HAMMING_CHECK_WORDS - 1U)
+                continue;
+
+            alive = 0U;
+#pragma GCC unroll 8
+            for (ph = 0U; ph < 8U; ph++)
+                alive |= (unsigned int) (nr_errors[ph] <= pat->max_errors) <<
+                         ph;
+        }
+
+        for (ph = 0U; ph < 8U; ph++) {
+            pos = idx * 8U + ph;
+
+            /* The pattern started before the range. */
+            if (pos < offset)
+                continue;
+
+            /* The rest of matches can't fit the range either. */
+            if (pos > end || end - pos < pat->nr_bits)
+                return ret_val;
+
+            if (nr_errors[ph] <= pat->max_errors) {
+                ret_val = BM_FOUND;
+                if (report_match(sink, pos))
+                    return BM_FOUND;
+            }
+        }
+    }
+
+    pos = idx * 8U > offset ? idx * 8U : offset;
+
+    for (; pos <= end && end - pos >= pat->nr_bits; pos++) {
+        if (count_errors(pat, buf, pos, pat->max_errors, sink) <=
+            pat->max_errors) {
+            ret_val = BM_FOUND;
+            if (report_match(sink, pos))
+                return BM_FOUND;
+        }
+    }
+
+    return ret_val;
+}
+
+static int scan_hamming_all(const struct bm_pattern *pat,
+                            const unsigned char *buf,
+                            size_t offset,
+                            size_t end,
+                            struct bm_sink *sink)
+{
+    return run_hamming_all(pat, buf, offset, end, sink);
+}
+
+#ifdef HAVE_SIMD
+__attribute__((target("popcnt")))
+static int scan_hamming_all_popcnt(const struct bm_pattern *pat,
+                                   const unsigned char *buf,
+                                   size_t offset,
+                                   size_t end,
+                                   struct bm_sink *sink)
+{
+    return run_hamming_all(pat, buf, offset, end, sink);
+}
+#endif
+
+/* Locate the positions where the data differs from the pattern
+   in at most max_errors bits. See init_hamming() for the filter
+   which finds out the distances for 8 phases of each byte at once.
+   The positions passing the filter are verified by count_errors()
+   unless the window covers the whole pattern. Once too many of them
+   are rejected, the rest of the range is scanned by pat->fallback,
+   one of the engines above.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits. */
+static int scan_hamming(const struct bm_pattern *pat,
+                        const unsigned char *buf,
+                        size_t offset,
+                        size_t end,
+                        struct bm_sink *sink)
+{
+    const uint64_t tops = UINT64_C(0x8080808080808080);
+    size_t idx, avail = (end + 7U) / 8U, pos, nr_failures = 0U;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    /* The window must fit the data at any phase of byte @idx. */
+    for (idx = (offset + pat->hd_offset) / 8U;
+         avail - idx >= pat->hd_len;
+         idx++) {
+        const unsigned char *data = buf + idx;
+        uint64_t lanes = 0U, hits;
+        size_t i;
+
+        for (i = 0U; i < pat->hd_len; i++)
+            lanes += pat->hd_tables[256U * i + data[i]];
+
+        hits = ~(lanes + pat->hd_bias) & tops;
+
+        while (hits != 0U) {
+            unsigned int ph = (unsigned int) __builtin_ctzll(hits) / 8U;
+
+            hits &= hits - 1U;
+            pos = idx * 8U + ph;
+
+            /* The pattern started before the range. */
+            if (pos < offset + pat->hd_offset)
+                continue;
+
+            pos -= pat->hd_offset;
+
+            /* The rest of matches can't fit the range either. */
+            if (pos > end || end - pos < pat->nr_bits)
+                return ret_val;
+
+            if (pat->hd_bits == pat->nr_bits ||
+                count_errors(pat, buf, pos, pat->max_errors, sink) <=
+                pat->max_errors) {
+                ret_val = BM_FOUND;
+                if (report_match(sink, pos))
+                    return BM_FOUND;
+            } else if (++nr_failures > FILTER_BASE_FAILURES +
+                                       (idx - offset / 8U) /
+                                       FILTER_FAILURE_RATIO) {
+                /* Every position before this one has been handled. */
+                if (pat->fallback(pat, buf, pos, end, sink) == BM_FOUND)
+                    ret_val = BM_FOUND;
+                return ret_val;
+            }
+        }
+    }
+
+    /* The positions whose window doesn't fit the data at some phase
+       are checked one by one. */
+    pos = idx * 8U > offset + pat->hd_offset ?
+          idx * 8U - pat->hd_offset : offset;
+
+    for (; pos <= end && end - pos >= pat->nr_bits; pos++) {
+        if (count_errors(pat, buf, pos, pat->max_errors, sink) <=
+            pat->max_errors) {
+            ret_val = BM_FOUND;
+            if (report_match(sink, pos))
+                return BM_FOUND;
+        }
+    }
+
+    return ret_val;
+}
+
+/* Locate occurrences of the pattern
+   by using Rabin–Karp algorithm. Hashes are computed fast
+   because we use rolling hash function.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits.
+
+   Let BkBk-1...B2B1B0 be the bit string.
+   The hash function F is computed as follows:
+     F = (Bk * (2 ** k) + ... + B2 * (2 ** 2) + B1 * 2 + B0) mod P
+   where P is the Mersenne prime 2 ** 61 - 1. Such a large modulus makes
+   accidental hash collisions, and thus needless verifications, negligible.
+   In order to eliminate the most significant addend
+   we use pre-computed value that is -(2 ** k) == P - (2 ** k) mod P.
+   So if Bk == 0 we have nothing to do since the largest power
+   is nullified. Else Bk == 1 and we add pre-computed value thus
+   cancelling the effect of the largest exponent out.
+*/
+static int scan_rabin_karp(const struct bm_pattern *pat,
+                           const unsigned char *buf,
+                           size_t offset,
+                           size_t end,
+                           struct bm_sink *sink)
+{
+    uint64_t hash = 0U;
+    size_t start, count;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    /* Compute hash value of the first K (=number of bits in the pattern)
+       data bits. */
+    for (start = offset;
+         offset - start < pat->nr_bits;
+         offset += count) {
+        size_t nr_remained;
+
+        nr_remained = pat->nr_bits - (offset - start);
+        count = nr_remained < 8U ? nr_remained : 8U;
+
+        hash = hash_shift(hash,
+                          count,
+                          extract_bitfield(buf, offset, count));
+    }
+
+    while (offset < end) {
+        /* Try to match the current hash value. */
+        if (hash == pat->hash &&
+            match(pat, buf, offset - pat->nr_bits, sink) == BM_FOUND) {
+            ret_val = BM_FOUND;
+            if (report_match(sink, offset - pat->nr_bits))
+                return BM_FOUND;
+        }
+
+        /* Advance the window by the whole byte once it ends at byte boundary.
+           The hashes of the windows ending inside the byte are computed
+           only if the last bits of the window match those of the pattern. */
+        if (offset % 8U == 0U && end - offset >= 8U) {
+            size_t out_offset = offset - pat->nr_bits;
+            unsigned int in, out, hits, k;
+
+            in = buf[offset / 8U];
+            out = buf[out_offset / 8U];
+            if (out_offset % 8U != 0U)
+                out = ((out << 8U | buf[out_offset / 8U + 1U]) >>
+                       (8U - out_offset % 8U)) & 0xFFU;
+
+            hits = pat->rk_tails[buf[offset / 8U - 1U] << 8U | in];
+
+            for (k = 1U; hits != 0U; k++) {
+                if ((hits & (1U << k)) == 0U)
+                    continue;
+
+                hits &= ~(1U << k);
+
+                if (hash_reduce(hash_shift(hash, k, in >> (8U - k)) +
+                                pat->rk_out[out >> (8U - k)]) == pat->hash &&
+                    match(pat,
+                          buf,
+                          offset + k - pat->nr_bits,
+                          sink) == BM_FOUND) {
+                    ret_val = BM_FOUND;
+                    if (report_match(sink, offset + k - pat->nr_bits))
+                        return BM_FOUND;
+                }
+            }
+
+            /* The window ending at the byte boundary is checked
+               on the next iteration. */
+            hash = hash_reduce(hash_shift(hash, 8U, in) + pat->rk_out[out]);
+            offset += 8U;
+            continue;
+        }
+
+        /* Do we need to nullify the effect of the largest exponent
+           on hash value? */
+        if (extract_bitfield(buf, offset - pat->nr_bits, 1) == 1U)
+            hash = hash_reduce(hash + pat->rnum);
+
+        hash = hash_shift(hash, 1U, extract_bitfield(buf, offset, 1));
+        offset++;
+    }
+
+    /* The last possible match. */
+    if (hash == pat->hash &&
+        match(pat, buf, offset - pat->nr_bits, sink) == BM_FOUND) {
+        ret_val = BM_FOUND;
+        report_match(sink, offset - pat->nr_bits);
+    }
+
+    return ret_val;
+}
+
+/* Reports the matches found by shift-and automaton which has just
+   consumed @nr_bytes bytes starting at byte @idx. Bit B of @hits is set
+   if the recognized part of the pattern ends B bits before the end of
+   the last of them. The matches are verified unless the automaton
+   recognizes the whole pattern. The rejected ones are counted in
+   *@nr_failures, and once there are too many of them, the rest of
+   the range is scanned by scan_long_shift_and() if the pattern has it.
+   Returns non-zero if the scan should stop, because either @sink asks to,
+   the rest of the matches can't fit the range [@offset, @end) or
+   the range is scanned to the end. *@ret_val is set to BM_FOUND once
+   any match is reported. */
+__attribute__((always_inline))
+static inline int report_shift_and(const struct bm_pattern *pat,
+                                   const unsigned char *buf,
+                                   size_t offset,
+                                   size_t end,
+                                   struct bm_sink *sink,
+                                   size_t idx,
+                                   size_t nr_bytes,
+                                   uint64_t hits,
+                                   size_t nr_bits,
+                                   size_t nr_sa_bits,
+                                   size_t *nr_failures,
+                                   int *ret_val)
+{
+    /* The whole pattern is recognized starting from its first bit. */
+    size_t sa_offset = nr_sa_bits == nr_bits ? 0U : pat->sa_offset;
+
+    /* Traverse the hits from the earliest one. */
+    while (hits != 0U) {
+        unsigned int b = 63U - (unsigned int) __builtin_clzll(hits);
+        size_t pos = (idx + nr_bytes) * 8U - b - nr_sa_bits;
+
+        hits &= ~((uint64_t) 1U << b);
+
+        /* The pattern started before the range. */
+        if (pos < offset + sa_offset)
+            continue;
+
+        pos -= sa_offset;
+
+        /* The rest of matches can't fit the range either. */
+        if (pos > end || end - pos < nr_bits)
+            return 1;
+
+        if (nr_sa_bits == nr_bits || match(pat, buf, pos, sink) == BM_FOUND) {
+            *ret_val = BM_FOUND;
+            if (report_match(sink, pos))
+                return 1;
+        } else if (pat->sa_long_masks != NULL &&
+                   ++*nr_failures > FILTER_BASE_FAILURES +
+                                    (idx - offset / 8U) /
+                                    FILTER_FAILURE_RATIO) {
+            /* Every position before this one has been handled. */
+            if (scan_long_shift_and(pat, buf, pos, end, sink) == BM_FOUND)
+                *ret_val = BM_FOUND;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Feeds @byte to shift-and automaton recognizing @nr_sa_bits pattern bits.
+   Returns the hits in the same form as the steps of run_shift_and() do.
+   *@state_hi holds the bits of the state above the first 64 ones,
+   it is used only if the state doesn't fit a word. */
+__attribute__((always_inline))
+static inline uint64_t feed_shift_and(const struct bm_pattern *pat,
+                                      uint64_t *state,
+                                      uint64_t *state_hi,
+                                      unsigned char byte,
+                                      size_t nr_sa_bits)
+{
+    if (nr_sa_bits <= SHIFT_AND_WORD_BITS) {
+        *state = ((*state << 8U) | 0xFFU) & pat->sa_masks[byte];
+        return (*state >> (nr_sa_bits - 1U)) & 0xFFU;
+    }
+
+    *state_hi = ((*state_hi << 8U) | (*state >> (SHIFT_AND_MAX_BITS - 8U))) &
+                pat->sa_masks_hi[byte];
+    *state = ((*state << 8U) | 0xFFU) & pat->sa_masks[byte];
+    return ((*state >> (nr_sa_bits - 1U)) |
+            (*state_hi << (SHIFT_AND_MAX_BITS + 1U - nr_sa_bits))) & 0xFFU;
+}
+
+/* Locate occurrences of the pattern
+   by running shift-and automaton over the input @nr_step bytes at a time.
+   See init_shift_and() for the details. The masks of consecutive bytes
+   are combined the way the automaton applies them:
+     D' = ((D << 8 * N) | (2 ** (8 * N) - 1)) & C
+     C = (M1 << 8 * (N - 1) | (2 ** (8 * (N - 1)) - 1)) & ... & MN
+   The combined mask is computed apart from the state, so
+   the state changes once per @nr_step bytes. Since the automaton ignores
+   the bits beyond its pattern bits and 7 wildcards, the hits of
+   earlier bytes are kept in the state above the ones of the last byte
+   as long as it has room for them. So @nr_step is at most
+   SHIFT_AND_STEP(@nr_sa_bits). Two word state is fed by feed_shift_and().
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits.
+   The body is inlined into each of the engines below, so the ones
+   specialised for a pattern length get the lengths and the step
+   as constants and have the step unrolled. */
+__attribute__((always_inline))
+static inline int run_shift_and(const struct bm_pattern *pat,
+                                const unsigned char *buf,
+                                size_t offset,
+                                size_t end,
+                                struct bm_sink *sink,
+                                size_t nr_bits,
+                                size_t nr_sa_bits,
+                                size_t nr_step)
+{
+    uint64_t state = 0U, state_hi = 0U, hits;
+    size_t idx, last, i, nr_failures = 0U;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= nr_bits);
+    assert(pat->nr_bits == nr_bits && pat->nr_sa_bits == nr_sa_bits);
+    assert(nr_step >= 1U && nr_step <= SHIFT_AND_STEP(nr_sa_bits));
+
+    idx = offset / 8U;
+    last = (end + 7U) / 8U;
+
+    for (; nr_step > 1U && last - idx >= nr_step; idx += nr_step) {
+        uint64_t mask = ~(uint64_t) 0U;
+
+#pragma GCC unroll 8
+        for (i = 0U; i < nr_step; i++)
+            mask &= (pat->sa_masks[buf[idx + i]] << (8U * (nr_step - 1U - i))) |
+                    (((uint64_t) 1U << (8U * (nr_step - 1U - i))) - 1U);
+
+        state = ((state << (8U * nr_step - 1U) << 1U) |
+                 (((uint64_t) 1U << (8U * nr_step - 1U) << 1U) - 1U)) & mask;
+        hits = (state >> (nr_sa_bits - 1U)) &
+               (((uint64_t) 1U << (8U * nr_step - 1U) << 1U) - 1U);
+
+        if (hits != 0U &&
+            report_shift_and(pat, buf, offset, end, sink, idx, nr_step, hits,
+                             nr_bits, nr_sa_bits, &nr_failures, &ret_val))
+            return ret_val;
+    }
+
+    /* The bytes left over by the step, one at a time. */
+    for (; idx < last; idx++) {
+        hits = feed_shift_and(pat, &state, &state_hi, buf[idx], nr_sa_bits);
+
+        if (hits != 0U &&
+            report_shift_and(pat, buf, offset, end, sink, idx, 1U, hits,
+                             nr_bits, nr_sa_bits, &nr_failures, &ret_val))
+            return ret_val;
+    }
+
+    return ret_val;
+}
+
+static int scan_shift_and(const struct bm_pattern *pat,
+                          const unsigned char *buf,
+                          size_t offset,
+                          size_t end,
+                          struct bm_sink *sink)
+{
+    return run_shift_and(pat,
+                         buf,
+                         offset,
+                         end,
+                         sink,
+                         pat->nr_bits,
+                         pat->nr_sa_bits,
+                         1U);
+}
+
+/* Locate occurrences of the pattern by running shift-and automaton
+   recognizing all of its bits a byte at a time. See init_long_shift_and()
+   for the masks. Each byte shifts and masks every word of the state,
+   so the time taken doesn't depend on the data. The engine takes over
+   from the one verifying the hits of the window of a long masked pattern
+   once too many of them are rejected.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits. */
+static int scan_long_shift_and(const struct bm_pattern *pat,
+                               const unsigned char *buf,
+                               size_t offset,
+                               size_t end,
+                               struct bm_sink *sink)
+{
+    const size_t nr_words = pat->nr_sa_long_words;
+    /* The hits are taken from bits nr_bits - 1 ... nr_bits + 6. */
+    const size_t hit_word = (pat->nr_bits - 1U) / 64U;
+    const unsigned int hit_shift = (unsigned int) ((pat->nr_bits - 1U) % 64U);
+    uint64_t state[SHIFT_AND_LONG_MAX_WORDS], hits;
+    size_t idx, last, w, nr_failures = 0U;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+    assert(nr_words != 0U && nr_words <= SHIFT_AND_LONG_MAX_WORDS);
+
+    memset(state, 0, nr_words * sizeof(*state));
+
+    idx = offset / 8U;
+    last = (end + 7U) / 8U;
+
+    for (; idx < last; idx++) {
+        const uint64_t *mask = pat->sa_long_masks + nr_words * buf[idx];
+
+        for (w = nr_words - 1U; w > 0U; w--)
+            state[w] = ((state[w] << 8U) | (state[w - 1U] >> 56U)) & mask[w];
+        state[0] = ((state[0] << 8U) | 0xFFU) & mask[0];
+
+        hits = state[hit_word] >> hit_shift;
+        if (hit_shift > 56U)
+            hits |= state[hit_word + 1U] << (64U - hit_shift);
+        hits &= 0xFFU;
+
+        /* The automaton recognizes the whole pattern,
+           so the hits are never verified. */
+        if (hits != 0U &&
+            report_shift_and(pat, buf, offset, end, sink, idx, 1U, hits,
+                             pat->nr_bits, pat->nr_bits, &nr_failures,
+                             &ret_val))
+            return ret_val;
+    }
+
+    return ret_val;
+}
+
+/* Adds the number of the matches found by shift-and automaton which has
+   just consumed @nr_bytes bytes starting at byte @idx to @nr_matches.
+   Bit B of @hits is set if the pattern of @nr_bits bits ends B bits before
+   the end of the last of them. Only the matches within
+   the range [@offset, @end) are counted. */
+__attribute__((always_inline))
+static inline size_t count_hits(size_t offset,
+                                size_t end,
+                                size_t idx,
+                                size_t nr_bytes,
+                                uint64_t hits,
+                                size_t nr_bits,
+                                size_t nr_matches)
+{
+    /* All the matches ending in these bytes fit the range. */
+    if (idx * 8U + 1U >= offset + nr_bits && (idx + nr_bytes) * 8U <= end)
+        return nr_matches + (size_t) __builtin_popcountll(hits);
+
+    while (hits != 0U) {
+        unsigned int b = (unsigned int) __builtin_ctzll(hits);
+        size_t pos = (idx + nr_bytes) * 8U - b - nr_bits;
+
+        hits &= hits - 1U;
+
+        if (pos >= offset && pos + nr_bits <= end)
+            nr_matches++;
+    }
+
+    return nr_matches;
+}
+
+/* Counts occurrences of the pattern, including overlapping ones,
+   by running shift-and automaton the same way run_shift_and() does.
+   Each step yields the mask of matches ending in its bytes, so the matches
+   are counted by the mask population. Only the bytes near the ends of
+   the range need to check whether the matches fit it.
+   The whole pattern must be recognized by the automaton.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits. */
+__attribute__((always_inline))
+static inline size_t run_count_shift_and(const struct bm_pattern *pat,
+                                         const unsigned char *buf,
+                                         size_t offset,
+                                         size_t end,
+                                         size_t nr_bits,
+                                         size_t nr_step)
+{
+    uint64_t state = 0U, state_hi = 0U, hits;
+    size_t idx, last, i, nr_matches = 0U;
+
+    assert(offset <= end && end - offset >= nr_bits);
+    assert(pat->nr_bits == nr_bits && pat->nr_sa_bits == nr_bits);
+    assert(nr_step >= 1U && nr_step <= SHIFT_AND_STEP(nr_bits));
+
+    idx = offset / 8U;
+    last = (end + 7U) / 8U;
+
+    for (; nr_step > 1U && last - idx >= nr_step; idx += nr_step) {
+        uint64_t mask = ~(uint64_t) 0U;
+
+#pragma GCC unroll 8
+        for (i = 0U; i < nr_step; i++)
+            mask &= (pat->sa_masks[buf[idx + i]] << (8U * (nr_step - 1U - i))) |
+                    (((uint64_t) 1U << (8U * (nr_step - 1U - i))) - 1U);
+
+        state = ((state << (8U * nr_step - 1U) << 1U) |
+                 (((uint64_t) 1U << (8U * nr_step - 1U) << 1U) - 1U)) & mask;
+        hits = (state >> (nr_bits - 1U)) &
+               (((uint64_t) 1U << (8U * nr_step - 1U) << 1U) - 1U);
+
+        if (hits != 0U)
+            nr_matches = count_hits(offset, end, idx, nr_step, hits,
+                                    nr_bits, nr_matches);
+    }
+
+    for (; idx < last; idx++) {
+        hits = feed_shift_and(pat, &state, &state_hi, buf[idx], nr_bits);
+
+        if (hits != 0U)
+            nr_matches = count_hits(offset, end, idx, 1U, hits,
+                                    nr_bits, nr_matches);
+    }
+
+    return nr_matches;
+}
+
+static size_t count_shift_and(const struct bm_pattern *pat,
+                              const unsigned char *buf,
+                              size_t offset,
+                              size_t end)
+{
+    return run_count_shift_and(pat, buf, offset, end, pat->nr_bits, 1U);
+}
+
+/* Defines scan_shift_and_N() and count_shift_and_N() for the patterns
+   of N bits recognized by the automaton entirely. */
+#define SHIFT_AND_KERNELS(N)                                               \
+static int scan_shift_and_##N(const struct bm_pattern *pat,                \
+                              const unsigned char *buf,                    \
+                              size_t offset,                               \
+                              size_t end,                                  \
+                              struct bm_sink *sink)                        \
+{                                                                          \
+    return run_shift_and(pat, buf, offset, end, sink,                      \
+                         N##U, N##U, SHIFT_AND_STEP(N##U));                \
+}                                                                          \
+                                                                           \
+static size_t count_shift_and_##N(const struct bm_pattern *pat,            \
+                                  const unsigned char *buf,                \
+                                  size_t offset,                           \
+                                  size_t end)                              \
+{                                                                          \
+    return run_count_shift_and(pat, buf, offset, end,                      \
+                               N##U, SHIFT_AND_STEP(N##U));                \
+}
+
+SHIFT_AND_KERNELS(8)
+SHIFT_AND_KERNELS(16)
+SHIFT_AND_KERNELS(24)
+SHIFT_AND_KERNELS(32)
+SHIFT_AND_KERNELS(48)
+SHIFT_AND_KERNELS(64)
+
+/* Shift-and engines specialised for the common pattern lengths,
+   such as the sync words and the headers of the frames. */
+static const struct shift_and_kernel {
+    size_t nr_bits;
+    int (*engine)(const struct bm_pattern *pat,
+                  const unsigned char *buf,
+                  size_t offset,
+                  size_t end,
+                  struct bm_sink *sink);
+    size_t (*counter)(const struct bm_pattern *pat,
+                      const unsigned char *buf,
+                      size_t offset,
+                      size_t end);
+} shift_and_kernels[] = {
+    {  8U, scan_shift_and_8,  count_shift_and_8  },
+    { 16U, scan_shift_and_16, count_shift_and_16 },
+    { 24U, scan_shift_and_24, count_shift_and_24 },
+    { 32U, scan_shift_and_32, count_shift_and_32 },
+    { 48U, scan_shift_and_48, count_shift_and_48 },
+    { 64U, scan_shift_and_64, count_shift_and_64 },
+};
+
+/* Makes the pattern use shift-and engine prepared by init_shift_and().
+   The one specialised for the pattern length is taken if there is such. */
+static void use_shift_and_kernel(struct bm_pattern *pat)
+{
+    size_t i;
+
+    pat->engine = scan_shift_and;
+    /* Shift-and hits need no verification for short patterns. */
+    pat->counter = pat->nr_sa_bits == pat->nr_bits ? count_shift_and : NULL;
+
+    for (i = 0U; i < sizeof(shift_and_kernels) / sizeof(shift_and_kernels[0]);
+         i++) {
+        if (shift_and_kernels[i].nr_bits == pat->nr_bits) {
+            pat->engine = shift_and_kernels[i].engine;
+            pat->counter = shift_and_kernels[i].counter;
+            break;
+        }
+    }
+}
+
+/* Checks the partially covered bytes around the entire ones
+   found by the prefilter at byte @idx.
+   The verification is accounted for in the statistics of @sink. */
+static int match_edges(const struct bit_phase *phase,
+                       const unsigned char *buf,
+                       size_t idx,
+                       struct bm_sink *sink)
+{
+    int ret_val = BM_FOUND;
+
+    if (phase->head_mask != 0U &&
+        ((buf[idx - 1U] ^ phase->buf[0]) & phase->head_mask) != 0U)
+        ret_val = BM_NOT_FOUND;
+    else if (phase->tail_mask != 0U &&
+             ((buf[idx + phase->len] ^
+               phase->buf[phase->head + phase->len]) &
+              phase->tail_mask) != 0U)
+        ret_val = BM_NOT_FOUND;
+
+    count_verified(sink, ret_val);
+    return ret_val;
+}
+
+/* Locate occurrences of the pattern
+   by searching for the bytes it covers entirely with memmem().
+   Each of 8 phases is searched independently and the candidate
+   with the least bit offset is verified first.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits.
+
+   Periodic data (e.g. long runs of zeros) may produce a candidate per byte
+   which fail at the edges. Once too many candidates are rejected,
+   the rest of the range is scanned by Rabin–Karp engine which runs in
+   linear time regardless of the data. */
+static int scan_prefilter(const struct bm_pattern *pat,
+                          const unsigned char *buf,
+                          size_t offset,
+                          size_t end,
+                          struct bm_sink *sink)
+{
+    /* Byte index of the next candidate for each phase.
+       SIZE_MAX if there are no more candidates. */
+    size_t cands[8], nr_failures = 0U, limit = end / 8U;
+    /* The phase whose candidate was consumed. 8 forces the search for all. */
+    unsigned int ph = 8U, i;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    /* Candidates of the phases which start in the middle of a byte
+       can't be found in the very first byte. */
+    for (i = 0U; i < 8U; i++)
+        cands[i] = offset / 8U + (offset < 8U ? pat->phases[i].head : 0U);
+
+    while (1) {
+        size_t pos = SIZE_MAX;
+        unsigned int best = 0U;
+
+        for (i = 0U; i < 8U; i++) {
+            const struct bit_phase *phase = &pat->phases[i];
+            size_t from = cands[i];
+
+            if ((i == ph || ph == 8U) && from != SIZE_MAX) {
+                const unsigned char *found = NULL;
+
+                if (from < limit && limit - from >= phase->len)
+                    found = memmem(buf + from, limit - from,
+                                   phase->buf + phase->head, phase->len);
+
+                cands[i] = found != NULL ? (size_t) (found - buf) : SIZE_MAX;
+            }
+
+            if (cands[i] != SIZE_MAX) {
+                size_t start = (cands[i] - phase->head) * 8U + i;
+
+                if (start < pos) {
+                    pos = start;
+                    best = i;
+                }
+            }
+        }
+
+        ph = best;
+
+        /* No candidates left or the earliest one doesn't fit the range. */
+        if (pos == SIZE_MAX || pos > end || end - pos < pat->nr_bits)
+            return ret_val;
+
+        if (pos < offset) {
+            /* The candidate started before the range. */
+        } else if (match_edges(&pat->phases[ph],
+                               buf,
+                               cands[ph],
+                               sink) == BM_FOUND) {
+            ret_val = BM_FOUND;
+            if (report_match(sink, pos))
+                return BM_FOUND;
+        } else if (++nr_failures > FILTER_BASE_FAILURES +
+                                   (cands[ph] - offset / 8U) /
+                                   FILTER_FAILURE_RATIO) {
+            /* Every position before this one has been handled. */
+            if (scan_rabin_karp(pat, buf, pos, end, sink) == BM_FOUND)
+                ret_val = BM_FOUND;
+            return ret_val;
+        }
+
+        cands[ph]++;
+    }
+}
+
+/* Locate occurrences of the pattern by sliding the window over
+   the input and skipping up to hp_len - 1 bytes at once.
+   See init_horspool() for the details. The window at byte W holds
+   the candidates for each phase PH starting at bit (W - head) * 8 + PH.
+   They are verified by match() in order of their bit offsets,
+   that is from phase 1 to 7 and then phase 0.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits.
+
+   The data of low entropy, such as long runs of zeros, occurs
+   within the pattern often, so the shifts are short and many windows
+   are candidates which fail. Once too many windows are looked at or
+   too many candidates are rejected, the rest of the range is scanned
+   by the engine which would be chosen for the pattern otherwise. */
+static int scan_horspool(const struct bm_pattern *pat,
+                         const unsigned char *buf,
+                         size_t offset,
+                         size_t end,
+                         struct bm_sink *sink)
+{
+    /* The last window holding a candidate which fits the range. */
+    size_t last = (end - pat->nr_bits + 7U) / 8U;
+    size_t idx, nr_windows = 0U, nr_failures = 0U, len = pat->hp_len;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    for (idx = offset / 8U; idx <= last;) {
+        unsigned int i, first, second, shift;
+
+        if (++nr_windows > FILTER_BASE_FAILURES +
+                           (idx - offset / 8U) / HORSPOOL_MIN_SHIFT)
+            break;
+
+        first = buf[idx + len - 2U];
+        second = buf[idx + len - 1U];
+        shift = pat->hp_shifts[first << 8U | second];
+
+        if (last - idx > HORSPOOL_PREFETCH)
+            __builtin_prefetch(buf + idx + len + HORSPOOL_PREFETCH);
+
+        if (shift != 0U) {
+            idx += shift;
+            continue;
+        }
+
+        for (i = 1U; i <= 8U; i++) {
+            const struct bit_phase *phase = &pat->phases[i % 8U];
+            const unsigned char *copy = phase->buf + phase->head;
+            size_t pos;
+
+            if (copy[len - 2U] != first || copy[len - 1U] != second ||
+                idx < phase->head)
+                continue;
+
+            pos = (idx - phase->head) * 8U + i % 8U;
+
+            /* The candidate started before the range. */
+            if (pos < offset)
+                continue;
+
+            /* The rest of candidates can't fit the range either. */
+            if (pos > end || end - pos < pat->nr_bits)
+                return ret_val;
+
+            if (match(pat, buf, pos, sink) == BM_FOUND) {
+                ret_val = BM_FOUND;
+                if (report_match(sink, pos))
+                    return BM_FOUND;
+            } else if (++nr_failures > FILTER_BASE_FAILURES +
+                                       (idx - offset / 8U) /
+                                       FILTER_FAILURE_RATIO) {
+                /* Every position before this one has been handled. */
+                if (pat->hp_fallback(pat, buf, pos, end, sink) == BM_FOUND)
+                    ret_val = BM_FOUND;
+                return ret_val;
+            }
+        }
+
+        idx++;
+    }
+
+    /* Every candidate of the windows before this one has been handled. */
+    if (idx <= last) {
+        size_t pos = idx * 8U < 8U + offset ? offset : idx * 8U - 8U + 1U;
+
+        if (pat->hp_fallback(pat, buf, pos, end, sink) == BM_FOUND)
+            ret_val = BM_FOUND;
+    }
+
+    return ret_val;
+}
+
+/* Locate occurrences of the patterns of the set
+   by running Aho–Corasick automaton over the input.
+   See init_automaton() for the details. The automaton consumes the whole
+   byte at once unless some pattern ends in it. Such bytes are stepped
+   through a bit at a time to find out where the patterns end.
+   Matches are reported to @sink in order of their end offsets until
+   it asks to stop. Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->min_bits.
+
+   The ranges of adjacent scans overlap by (nr_bits - 1) bits so that
+   the longest pattern can be found across their boundary. The shorter
+   patterns ending within these bits are found by both scans, so
+   the caller of the later one tells to skip them by sink->skip_until. */
+static int scan_automaton(const struct bm_pattern *pat,
+                          const unsigned char *buf,
+                          size_t offset,
+                          size_t end,
+                          struct bm_sink *sink)
+{
+    const struct bit_automaton *ac = pat->automaton;
+    const size_t skip_until = sink->skip_until;
+    uint32_t state = 0U;
+    size_t pos = offset;
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->min_bits);
+    assert(skip_until <= offset + pat->nr_bits - 1U);
+
+    while (pos < end) {
+        uint32_t member, found;
+
+        if (pos % 8U == 0U && end - pos >= 8U && state < ac->nr_table_states) {
+            uint32_t next = ac->delta8[256U * (size_t) state + buf[pos / 8U]];
+
+            if ((next & AUTOMATON_HIT) == 0U) {
+                state = next;
+                pos += 8U;
+                continue;
+            }
+        }
+
+        state = ac->delta[2U * state +
+                          ((buf[pos / 8U] >> (7U - pos % 8U)) & 1U)];
+        pos++;
+
+        if (pos <= skip_until)
+            continue;
+
+        /* The patterns equal to the suffixes of the current state's prefix
+           end at the current bit. */
+        for (found = ac->first[state] != NO_MEMBER ? state : ac->suffix[state];
+             found != 0U;
+             found = ac->suffix[found]) {
+            for (member = ac->first[found];
+                 member != NO_MEMBER;
+                 member = ac->same[member]) {
+                ret_val = BM_FOUND;
+                if (report_member(sink,
+                                  pos - pat->members[member].nr_bits,
+                                  member))
+                    return BM_FOUND;
+            }
+        }
+    }
+
+    return ret_val;
+}
+
+#ifdef HAVE_SIMD
+/* Vector search routines below compare SIMD_WIDTH bytes at once,
+   each of them being considered the first byte of the pattern
+   at every of 8 phases. For byte I of the block,
+   bit I of masks[PH] is set if the pattern prefix starts at bit PH of it.
+   The routines scan the blocks starting at bytes [@idx, @last) and stop
+   at the first block having any candidates. Its index is returned.
+   If there are no candidates, the return value is not less than @last.
+   Bytes up to @last + SIMD_WIDTH + 1 are read. */
+
+__attribute__((target("sse2")))
+static size_t simd_find_sse2(const struct bm_pattern *pat,
+                             const unsigned char *buf,
+                             size_t idx,
+                             size_t last,
+                             uint64_t *masks)
+{
+    for (; idx < last; idx += 16U) {
+        __m128i v0, v1, v2;
+        unsigned int ph, any = 0U;
+
+        v0 = _mm_loadu_si128((const __m128i *) (buf + idx));
+        v1 = _mm_loadu_si128((const __m128i *) (buf + idx + 1U));
+        v2 = _mm_loadu_si128((const __m128i *) (buf + idx + 2U));
+
+        for (ph = 0U; ph < 8U; ph++) {
+            const unsigned char *vals = pat->simd_vals[ph];
+            const unsigned char *msks = pat->simd_masks[ph];
+            __m128i eq;
+
+            eq = _mm_cmpeq_epi8(_mm_and_si128(v0, _mm_set1_epi8((char) msks[0])),
+                                _mm_set1_epi8((char) vals[0]));
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi8(v1, _mm_set1_epi8((char) vals[1])));
+            eq = _mm_and_si128(eq,
+                               _mm_cmpeq_epi8(_mm_and_si128(v2, _mm_set1_epi8((char) msks[2])),
+                                              _mm_set1_epi8((char) vals[2])));
+
+            masks[ph] = (unsigned int) _mm_movemask_epi8(eq);
+            any |= (unsigned int) masks[ph];
+        }
+
+        if (any != 0U)
+            break;
+    }
+
+    return idx;
+}
+
+__attribute__((target("avx2")))
+static size_t simd_find_avx2(const struct bm_pattern *pat,
+                             const unsigned char *buf,
+                             size_t idx,
+                             size_t last,
+                             uint64_t *masks)
+{
+    for (; idx < last; idx += 32U) {
+        __m256i v0, v1, v2;
+        unsigned int ph, any = 0U;
+
+        v0 = _mm256_loadu_si256((const __m256i *) (buf + idx));
+        v1 = _mm256_loadu_si256((const __m256i *) (buf + idx + 1U));
+        v2 = _mm256_loadu_si256((const __m256i *) (buf + idx + 2U));
+
+        for (ph = 0U; ph < 8U; ph++) {
+            const unsigned char *vals = pat->simd_vals[ph];
+            const unsigned char *msks = pat->simd_masks[ph];
+            __m256i eq;
+
+            eq = _mm256_cmpeq_epi8(_mm256_and_si256(v0, _mm256_set1_epi8((char) msks[0])),
+                                   _mm256_set1_epi8((char) vals[0]));
+            eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(v1, _mm256_set1_epi8((char) vals[1])));
+            eq = _mm256_and_si256(eq,
+                                  _mm256_cmpeq_epi8(_mm256_and_si256(v2, _mm256_set1_epi8((char) msks[2])),
+                                                    _mm256_set1_epi8((char) vals[2])));
+
+            masks[ph] = (unsigned int) _mm256_movemask_epi8(eq);
+            any |= (unsigned int) masks[ph];
+        }
+
+        if (any != 0U)
+            break;
+    }
+
+    return idx;
+}
+
+__attribute__((target("avx512bw")))
+static size_t simd_find_avx512(const struct bm_pattern *pat,
+                               const unsigned char *buf,
+                               size_t idx,
+                               size_t last,
+                               uint64_t *masks)
+{
+    for (; idx < last; idx += 64U) {
+        __m512i v0, v1, v2;
+        unsigned int ph;
+        uint64_t any = 0U;
+
+        v0 = _mm512_loadu_si512((const void *) (buf + idx));
+        v1 = _mm512_loadu_si512((const void *) (buf + idx + 1U));
+        v2 = _mm512_loadu_si512((const void *) (buf + idx + 2U));
+
+        for (ph = 0U; ph < 8U; ph++) {
+            const unsigned char *vals = pat->simd_vals[ph];
+            const unsigned char *msks = pat->simd_masks[ph];
+            __mmask64 eq;
+
+            eq = _mm512_cmpeq_epi8_mask(_mm512_and_si512(v0, _mm512_set1_epi8((char) msks[0])),
+                                        _mm512_set1_epi8((char) vals[0]));
+            eq &= _mm512_cmpeq_epi8_mask(v1, _mm512_set1_epi8((char) vals[1]));
+            eq &= _mm512_cmpeq_epi8_mask(_mm512_and_si512(v2, _mm512_set1_epi8((char) msks[2])),
+                                         _mm512_set1_epi8((char) vals[2]));
+
+            masks[ph] = eq;
+            any |= eq;
+        }
+
+        if (any != 0U)
+            break;
+    }
+
+    return idx;
+}
+
+/* Chooses the widest vector search routine supported by the CPU
+   and pre-computes the pattern prefix for it.
+   Returns 0 if vector instructions can't be used. */
+static int init_simd(struct bm_pattern *pat)
+{
+    unsigned int prefix, ph, i;
+
+    /* The middle byte of the prefix is compared entirely at any phase,
+       so the prefix must have no don't care bits. */
+    if (pat->mask != NULL &&
+        (extract_bitfield(pat->mask, 0U, 8U) != 0xFFU ||
+         extract_bitfield(pat->mask, 8U, 8U) != 0xFFU))
+        return 0;
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512bw")) {
+        pat->simd_find = simd_find_avx512;
+        pat->simd_width = 64U;
+    } else if (__builtin_cpu_supports("avx2")) {
+        pat->simd_find = simd_find_avx2;
+        pat->simd_width = 32U;
+    } else if (__builtin_cpu_supports("sse2")) {
+        pat->simd_find = simd_find_sse2;
+        pat->simd_width = 16U;
+    } else {
+        return 0;
+    }
+
+    prefix = extract_bitfield(pat->buf, 0U, 8U) << 8U |
+             extract_bitfield(pat->buf, 8U, 8U);
+
+    for (ph = 0U; ph < 8U; ph++) {
+        uint32_t vals = (uint32_t) prefix << (8U - ph);
+        uint32_t msks = UINT32_C(0xFFFF) << (8U - ph);
+
+        for (i = 0U; i < 3U; i++) {
+            pat->simd_vals[ph][i] = (unsigned char) (vals >> (16U - 8U * i));
+            pat->simd_masks[ph][i] = (unsigned char) (msks >> (16U - 8U * i));
+        }
+    }
+
+    return 1;
+}
+
+/* Locate occurrences of the pattern
+   by verifying candidates found by the vector search routine.
+   The head and tail of the range which can't be loaded to vector registers,
+   as well as the rest of the range once too many candidates are
+   rejected, are scanned by the fallback engine.
+   Matches are reported to @sink in order until it asks to stop.
+   Only bits in range [@offset, @end) are examined, so
+   the caller must guarantee @end - @offset >= pat->nr_bits. */
+static int scan_simd(const struct bm_pattern *pat,
+                     const unsigned char *buf,
+                     size_t offset,
+                     size_t end,
+                     struct bm_sink *sink)
+{
+    size_t idx = offset / 8U, avail = (end + 7U) / 8U, last, pos;
+    size_t nr_failures = 0U;
+    uint64_t masks[8];
+    int ret_val = BM_NOT_FOUND;
+
+    assert(offset <= end && end - offset >= pat->nr_bits);
+
+    /* Vector loads span SIMD_WIDTH + 2 bytes. */
+    last = avail >= pat->simd_width + 2U ? avail - pat->simd_width - 1U : 0U;
+
+    while (idx < last) {
+        uint64_t any;
+        unsigned int ph;
+
+        idx = pat->simd_find(pat, buf, idx, last, masks);
+        if (idx >= last)
+            break;
+
+        for (any = 0U, ph = 0U; ph < 8U; ph++)
+            any |= masks[ph];
+
+        /* Candidates are tried in the order of their bit offsets. */
+        while (any != 0U) {
+            unsigned int b = (unsigned int) __builtin_ctzll(any);
+
+            any &= any - 1U;
+
+            for (ph = 0U; ph < 8U; ph++) {
+                if ((masks[ph] & ((uint64_t) 1U << b)) == 0U)
+                    continue;
+
+                pos = (idx + b) * 8U + ph;
+
+                if (pos < offset)
+                    continue;
+
+                if (pos > end || end - pos < pat->nr_bits)
+                    return ret_val;
+
+                if (match(pat, buf, pos, sink) == BM_FOUND) {
+                    ret_val = BM_FOUND;
+                    if (report_match(sink, pos))
+                        return BM_FOUND;
+                } else if (++nr_failures > FILTER_BASE_FAILURES +
+                                           (idx - offset / 8U) /
+                                           FILTER_FAILURE_RATIO) {
+                    /* Every position before this one has been handled. */
+                    if (pat->fallback(pat, buf, pos, end, sink) == BM_FOUND)
+                        ret_val = BM_FOUND;
+                    return ret_val;
+                }
+            }
+        }
+
+        idx += pat->simd_width;
+    }
+
+    /* Every position before the current block has been handled. */
+    pos = idx * 8U > offset ? idx * 8U : offset;
+    if (pos <= end && end - pos >= pat->nr_bits &&
+        pat->fallback(pat, buf, pos, end, sink) == BM_FOUND)
+        ret_val = BM_FOUND;
+
+    return ret_val;
+}
+#endif
+
+int bm_scan(const struct bm_pattern *pat,
+            const unsigned char *buf,
+            size_t offset,
+            size_t end,
+            struct bm_sink *sink)
+{
+    if (sink->nr_counted != NULL && pat->counter != NULL) {
+        size_t nr_matches = pat->counter(pat, buf, offset, end);
+
+        *sink->nr_counted += nr_matches;
+        return nr_matches != 0U ? BM_FOUND : BM_NOT_FOUND;
+    }
+
+    return pat->engine(pat, buf, offset, end, sink);
+}
+
+/* The data fed to the stream is scanned in pieces of up to FEED_CHUNK_SIZE
+   bytes. Each scan tries the (nr_bits - 1) bits carried over from
+   the previous piece once more, so the last piece of bm_feed() is scanned
+   right away only if it holds at least nr_bits bits. Otherwise it waits
+   for more data, bm_stream_flush() or bm_stream_finish(), so that
+   the data fed a few bytes at a time costs O(data) rather than
+   O(pattern) per call. Only the carried bits are kept between pieces,
+   so memory consumption doesn't depend on input size. */
+struct bm_stream {
+    const struct bm_pattern *pat;
+    struct bm_sink *sink;
+    /* The carried bits followed by the data fed since the last scan. */
+    unsigned char *buf;
+    /* The amount of bytes in the buffer and how many of them
+       were fed since the last scan. */
+    size_t len;
+    size_t nr_fresh;
+    /* The first bit of the buffer where a match hasn't been tried yet. */
+    size_t offset;
+    /* The end of the bits of the buffer scanned before, or 0. */
+    size_t skip_until;
+};
+
+int bm_stream_open(const struct bm_pattern *pat,
+                   struct bm_sink *sink,
+                   struct bm_stream **pstream)
+{
+    struct bm_stream *stream;
+
+    if ((stream = calloc(1U, sizeof(*stream))) == NULL)
+        return BM_NO_MEM;
+
+    /* (nr_bits - 1) bits starting at arbitrary offset within
+       the first byte never span more than (nr_bits / 8 + 2) bytes. */
+    stream->buf = malloc(pat->nr_bits / 8U + 2U + FEED_CHUNK_SIZE);
+    if (stream->buf == NULL) {
+        free(stream);
+        return BM_NO_MEM;
+    }
+
+    stream->pat = pat;
+    stream->sink = sink;
+    sink->base = 0U;
+    sink->skip_until = 0U;
+
+    *pstream = stream;
+    return BM_OK;
+}
+
+/* Scans the data in the buffer once it is enough for the longest pattern
+   of the set and keeps the bits where a match may still start. */
+static int flush_stream(struct bm_stream *stream)
+{
+    const struct bm_pattern *pat = stream->pat;
+    size_t end = stream->len * 8U, next;
+    int ret_val = BM_NOT_FOUND;
+
+    stream->nr_fresh = 0U;
+
+    if (end - stream->offset < pat->nr_bits)
+        return ret_val;
+
+    stream->sink->skip_until = stream->skip_until;
+    ret_val = bm_scan(pat, stream->buf, stream->offset, end, stream->sink);
+
+    /* The first position which hasn't been tried yet. */
+    next = end - pat->nr_bits + 1U;
+
+    stream->len -= next / 8U;
+    memmove(stream->buf, stream->buf + next / 8U, stream->len);
+    stream->offset = next % 8U;
+    stream->skip_until = end - next / 8U * 8U;
+    stream->sink->base += next / 8U * 8U;
+
+    return ret_val;
+}
+
+int bm_feed(struct bm_stream *stream, const unsigned char *data, size_t size)
+{
+    int ret_val = BM_NOT_FOUND;
+
+    while (size > 0U && !stream->sink->stopped) {
+        size_t count = FEED_CHUNK_SIZE - stream->nr_fresh;
+
+        if (count > size)
+            count = size;
+
+        memcpy(stream->buf + stream->len, data, count);
+        stream->len += count;
+        stream->nr_fresh += count;
+        data += count;
+        size -= count;
+
+        if (stream->nr_fresh == FEED_CHUNK_SIZE &&
+            flush_stream(stream) == BM_FOUND)
+            ret_val = BM_FOUND;
+    }
+
+    /* The data may come slowly from a pipe, so don't hold the matches
+       back until the piece is full once it outweighs the carried bits. */
+    if (stream->nr_fresh * 8U >= stream->pat->nr_bits &&
+        !stream->sink->stopped && flush_stream(stream) == BM_FOUND)
+        ret_val = BM_FOUND;
+
+    return ret_val;
+}
+
+int bm_stream_flush(struct bm_stream *stream)
+{
+    if (stream->nr_fresh == 0U || stream->sink->stopped)
+        return BM_NOT_FOUND;
+
+    return flush_stream(stream);
+}
+
+int bm_stream_finish(struct bm_stream *stream)
+{
+    const struct bm_pattern *pat = stream->pat;
+    size_t end = stream->len * 8U;
+
+    if (stream->sink->stopped)
+        return BM_NOT_FOUND;
+
+    if (end - stream->offset >= pat->nr_bits ||
+        (stream->skip_until == 0U && end >= pat->min_bits)) {
+        /* Either there is the data fed since the last scan,
+           or nothing has been scanned, but the data may still
+           contain the shorter patterns of the set. */
+        stream->sink->skip_until = stream->skip_until;
+        return bm_scan(pat, stream->buf, stream->offset, end, stream->sink);
+    }
+
+    return BM_NOT_FOUND;
+}
+
+void bm_stream_free(struct bm_stream *stream)
+{
+    if (stream == NULL)
+        return;
+
+    free(stream->buf);
+    free(stream);
+}
@@ -0,0 +1,175 @@
+/* Routines making the compiled pattern use particular engine
+   regardless of the one chosen by bm_compile(). They are shared by
+   the benchmark and the fuzzer, which include this file
+   after libbitmatch.c.
+   BM_NOT_FOUND is returned if the engine can't handle the pattern. */
+
+/* Keeps the engine chosen by bm_compile(). */
+static int use_auto(struct bm_pattern *pat)
+{
+    (void) pat;
+    return BM_OK;
+}
+
+/* The engines below look for exact matches of all bits of
+   a single pattern. */
+static int exact_only(const struct bm_pattern *pat)
+{
+    return pat->members == NULL && pat->mask == NULL &&
+           pat->max_errors == 0U;
+}
+
+static int use_rabin_karp(struct bm_pattern *pat)
+{
+    if (!exact_only(pat))
+        return BM_NOT_FOUND;
+
+    if (pat->rk_tails == NULL && init_rk_tails(pat) != BM_OK)
+        return BM_NO_MEM;
+
+    pat->engine = scan_rabin_karp;
+    pat->counter = NULL;
+    return BM_OK;
+}
+
+/* Shift-and engine handles masked patterns as well. The hits of
+   its window over a long pattern are verified until the automaton
+   over the whole pattern takes over, as for the masked ones. */
+static int use_shift_and(struct bm_pattern *pat)
+{
+    if (pat->members != NULL || pat->max_errors != 0U)
+        return BM_NOT_FOUND;
+
+    init_shift_and(pat);
+    use_shift_and_kernel(pat);
+
+    if (pat->nr_sa_bits < pat->nr_bits &&
+        pat->nr_bits <= SHIFT_AND_LONG_MAX_BITS &&
+        pat->sa_long_masks == NULL && init_long_shift_and(pat) != BM_OK)
+        return BM_NO_MEM;
+
+    return BM_OK;
+}
+
+static int use_prefilter(struct bm_pattern *pat)
+{
+    if (!exact_only(pat) || pat->nr_bits < 15U)
+        return BM_NOT_FOUND;
+
+    if (pat->rk_tails == NULL && init_rk_tails(pat) != BM_OK)
+        return BM_NO_MEM;
+    if (pat->phases[0].buf == NULL && init_prefilter(pat) != BM_OK)
+        return BM_NO_MEM;
+
+    pat->engine = scan_prefilter;
+    pat->counter = NULL;
+    return BM_OK;
+}
+
+/* The automaton over the whole pattern takes over from shift-and engine
+   for long masked patterns. It is run for the shorter and unmasked
+   patterns just as well. */
+static int use_long_shift_and(struct bm_pattern *pat)
+{
+    if (pat->members != NULL || pat->max_errors != 0U ||
+        pat->nr_bits > SHIFT_AND_LONG_MAX_BITS)
+        return BM_NOT_FOUND;
+
+    if (pat->sa_long_masks == NULL && init_long_shift_and(pat) != BM_OK)
+        return BM_NO_MEM;
+
+    pat->engine = scan_long_shift_and;
+    pat->counter = NULL;
+    return BM_OK;
+}
+
+/* Approximate matching without the filter, the fallback of the engine
+   chosen for the patterns with errors allowed. */
+static int use_hamming_all(struct bm_pattern *pat)
+{
+    if (pat->max_errors == 0U)
+        return BM_NOT_FOUND;
+
+    pat->engine = pat->fallback;
+    return BM_OK;
+}
+
+/* The skipping engine needs 2 bytes covered entirely at any phase. */
+static int use_horspool(struct bm_pattern *pat)
+{
+    if (!exact_only(pat) || pat->nr_bits < 23U)
+        return BM_NOT_FOUND;
+
+    if (pat->rk_tails == NULL && init_rk_tails(pat) != BM_OK)
+        return BM_NO_MEM;
+    if (pat->phases[0].buf == NULL && init_prefilter(pat) != BM_OK)
+        return BM_NO_MEM;
+    if (pat->hp_shifts == NULL) {
+        if (init_horspool(pat) != BM_OK)
+            return BM_NO_MEM;
+        pat->hp_fallback = scan_prefilter;
+    }
+
+    pat->engine = scan_horspool;
+    pat->counter = NULL;
+    return BM_OK;
+}
+
+#ifdef HAVE_SIMD
+/* The vector engine runs with the fallback chosen by bm_compile(),
+   so the pattern must be the one it prepared the engine for.
+   Only the search routine @find of @width bytes is replaced. */
+static int use_simd_find(struct bm_pattern *pat,
+                         size_t (*find)(const struct bm_pattern *pat,
+                                        const unsigned char *buf,
+                                        size_t idx,
+                                        size_t last,
+                                        uint64_t *masks),
+                         size_t width)
+{
+    if (pat->simd_find == NULL)
+        return BM_NOT_FOUND;
+
+    pat->simd_find = find;
+    pat->simd_width = width;
+    pat->engine = scan_simd;
+    return BM_OK;
+}
+#endif
+
+/* Each vector search routine is taken if the CPU supports it,
+   so the narrower ones are run on the CPUs supporting
+   the wider ones too. */
+
+static int use_simd_sse2(struct bm_pattern *pat)
+{
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return use_simd_find(pat, simd_find_sse2, 16U);
+#endif
+    (void) pat;
+    return BM_NOT_FOUND;
+}
+
+static int use_simd_avx2(struct bm_pattern *pat)
+{
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return use_simd_find(pat, simd_find_avx2, 32U);
+#endif
+    (void) pat;
+    return BM_NOT_FOUND;
+}
+
+static int use_simd_avx512(struct bm_pattern *pat)
+{
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return use_simd_find(pat, simd_find_avx512, 64U);
+#endif
+    (void) pat;
+    return BM_NOT_FOUND;
+}